@@ -0,0 +1,794 @@
+// SPDX-License-Identifier: GPL-3.0
+
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <format>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <Windows.h>
+
+#include "core.hpp"
+
+namespace
+{
+
+template<typename... Interfaces>
+class MockObject : public Interfaces...
+{
+  ULONG refCount {};
+
+protected:
+  virtual ~MockObject() {}
+
+public:
+  ULONG STDMETHODCALLTYPE AddRef() override
+  {
+    return InterlockedIncrement(&refCount);
+  }
+
+  ULONG STDMETHODCALLTYPE Release() override
+  {
+    auto result = InterlockedDecrement(&refCount);
+    if (result == 0) {
+      delete this;
+    }
+    return result;
+  }
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid,
+                                           void** ppvObject) override
+  {
+    if (ppvObject == nullptr) {
+      return E_POINTER;
+    }
+
+    using First = std::tuple_element_t<0, std::tuple<Interfaces...>>;
+    *ppvObject = nullptr;
+    if (__uuidof(IUnknown) == riid) {
+      *ppvObject = static_cast<First*>(this);
+    }
+    (void)((__uuidof(Interfaces) == riid
+            && (*ppvObject = static_cast<Interfaces*>(this), true))
+           || ...);
+    if (*ppvObject == nullptr) {
+      return E_NOINTERFACE;
+    }
+
+    AddRef();
+    return S_OK;
+  }
+};
+
+struct Counters
+{
+  LONG enforcementCalls {};
+  LONG64 costTicks {};
+};
+
+class MockEndpointVolume : public MockObject<IAudioEndpointVolume>
+{
+  SRWLOCK lock = SRWLOCK_INIT;
+  ComPtr<IAudioEndpointVolumeCallback> callback;
+  Counters* counters {};
+  LONG level {std::bit_cast<LONG>(1.0f)};
+
+public:
+  explicit MockEndpointVolume(Counters& counters)
+      : counters(&counters)
+  {
+  }
+
+  void fire(GUID const& context, float master = 1.0f)
+  {
+    auto data = AUDIO_VOLUME_NOTIFICATION_DATA {
+        .guidEventContext = context,
+        .bMuted = FALSE,
+        .fMasterVolume = master,
+        .nChannels = 1,
+        .afChannelVolumes = {master},
+    };
+    (void)InterlockedExchange(&level, std::bit_cast<LONG>(master));
+    AcquireSRWLockShared(&lock);
+    auto current = ComPtr<IAudioEndpointVolumeCallback>();
+    if (callback != nullptr) {
+      callback->AddRef();
+      current.reset(callback.get());
+    }
+    ReleaseSRWLockShared(&lock);
+    if (current != nullptr) {
+      (void)current->OnNotify(&data);
+    }
+  }
+
+  HRESULT STDMETHODCALLTYPE
+  RegisterControlChangeNotify(IAudioEndpointVolumeCallback* notify) override
+  {
+    notify->AddRef();
+    AcquireSRWLockExclusive(&lock);
+    callback.reset(notify);
+    ReleaseSRWLockExclusive(&lock);
+    return S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE
+  UnregisterControlChangeNotify(IAudioEndpointVolumeCallback*) override
+  {
+    AcquireSRWLockExclusive(&lock);
+    callback.reset();
+    ReleaseSRWLockExclusive(&lock);
+    return S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE GetChannelCount(UINT*) override
+  {
+    return E_NOTIMPL;
+  }
+
+  HRESULT STDMETHODCALLTYPE SetMasterVolumeLevel(float, LPCGUID) override
+  {
+    return E_NOTIMPL;
+  }
+
+  HRESULT STDMETHODCALLTYPE SetMasterVolumeLevelScalar(float value,
+                                                       LPCGUID context) override
+  {
+    (void)InterlockedIncrement(&counters->enforcementCalls);
+    auto until = performanceCounter() + counters->costTicks;
+    while (performanceCounter() < until) {
+      YieldProcessor();
+    }
+    fire(context != nullptr ? *context : GUID {}, value);
+    return S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE GetMasterVolumeLevel(float*) override
+  {
+    return E_NOTIMPL;
+  }
+
+  HRESULT STDMETHODCALLTYPE GetMasterVolumeLevelScalar(float* value) override
+  {
+    *value = std::bit_cast<float>(ReadNoFence(&level));
+    return S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE SetChannelVolumeLevel(UINT,
+                                                  float,
+                                                  LPCGUID) override
+  {
+    return E_NOTIMPL;
+  }
+
+  HRESULT STDMETHODCALLTYPE SetChannelVolumeLevelScalar(UINT,
+                                                        float,
+                                                        LPCGUID) override
+  {
+    return E_NOTIMPL;
+  }
+
+  HRESULT STDMETHODCALLTYPE GetChannelVolumeLevel(UINT, float*) override
+  {
+    return E_NOTIMPL;
+  }
+
+  HRESULT STDMETHODCALLTYPE GetChannelVolumeLevelScalar(UINT, float*) override
+  {
+    return E_NOTIMPL;
+  }
+
+  HRESULT STDMETHODCALLTYPE SetMute(BOOL, LPCGUID) override
+  {
+    return E_NOTIMPL;
+  }
+
+  HRESULT STDMETHODCALLTYPE GetMute(BOOL*) override { return E_NOTIMPL; }
+
+  HRESULT STDMETHODCALLTYPE GetVolumeStepInfo(UINT*, UINT*) override
+  {
+    return E_NOTIMPL;
+  }
+
+  HRESULT STDMETHODCALLTYPE VolumeStepUp(LPCGUID) override
+  {
+    return E_NOTIMPL;
+  }
+
+  HRESULT STDMETHODCALLTYPE VolumeStepDown(LPCGUID) override
+  {
+    return E_NOTIMPL;
+  }
+
+  HRESULT STDMETHODCALLTYPE QueryHardwareSupport(DWORD*) override
+  {
+    return E_NOTIMPL;
+  }
+
+  HRESULT STDMETHODCALLTYPE GetVolumeRange(float*, float*, float*) override
+  {
+    return E_NOTIMPL;
+  }
+};
+
+class MockDevice : public MockObject<IMMDevice, IMMEndpoint>
+{
+  std::wstring _id;
+  ComPtr<MockEndpointVolume> _volume;
+
+public:
+  MockDevice(std::wstring id, Counters& counters)
+      : _id(std::move(id))
+      , _volume(makeComObject<MockEndpointVolume>(counters))
+  {
+  }
+
+  std::wstring const& id() const { return _id; }
+
+  MockEndpointVolume& volume() const { return *_volume; }
+
+  HRESULT STDMETHODCALLTYPE Activate(REFIID iid,
+                                     DWORD,
+                                     PROPVARIANT*,
+                                     void** ppInterface) override
+  {
+    if (ppInterface == nullptr) {
+      return E_POINTER;
+    }
+
+    if (__uuidof(IAudioEndpointVolume) != iid) {
+      *ppInterface = nullptr;
+      return E_NOINTERFACE;
+    }
+
+    _volume->AddRef();
+    *ppInterface = static_cast<IAudioEndpointVolume*>(_volume.get());
+    return S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE OpenPropertyStore(DWORD, IPropertyStore**) override
+  {
+    return E_NOTIMPL;
+  }
+
+  HRESULT STDMETHODCALLTYPE GetId(LPWSTR* ppstrId) override
+  {
+    auto size = (_id.size() + 1) * sizeof(wchar_t);
+    *ppstrId = static_cast<LPWSTR>(CoTaskMemAlloc(size));
+    if (*ppstrId == nullptr) {
+      return E_OUTOFMEMORY;
+    }
+
+    std::memcpy(*ppstrId, _id.c_str(), size);
+    return S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE GetState(DWORD* pdwState) override
+  {
+    *pdwState = DEVICE_STATE_ACTIVE;
+    return S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE GetDataFlow(EDataFlow* pDataFlow) override
+  {
+    *pDataFlow = eRender;
+    return S_OK;
+  }
+};
+
+class MockDeviceEnumerator : public MockObject<IMMDeviceEnumerator>
+{
+  std::vector<MockDevice*> devices;
+  LONG defaultDevice {};
+
+  ~MockDeviceEnumerator() override
+  {
+    for (auto* device : devices) {
+      device->Release();
+    }
+  }
+
+public:
+  MockDeviceEnumerator(std::size_t count, Counters& counters)
+  {
+    for (auto i = std::size_t {}; i != count; ++i) {
+      auto device = std::make_unique<MockDevice>(
+          std::format(L"{{0.0.0.00000000}}.mock-{}", i), counters);
+      devices.push_back(device.get());
+      device.release()->AddRef();
+    }
+  }
+
+  MockDevice& current() const
+  {
+    return *devices[static_cast<std::size_t>(ReadAcquire(&defaultDevice))];
+  }
+
+  MockDevice& next()
+  {
+    auto index = (ReadNoFence(&defaultDevice) + 1)
+        % static_cast<LONG>(devices.size());
+    (void)InterlockedExchange(&defaultDevice, index);
+    return current();
+  }
+
+  MockDevice& device(std::size_t index) const
+  {
+    return *devices[index % devices.size()];
+  }
+
+  MockDevice& select(std::size_t index)
+  {
+    (void)InterlockedExchange(&defaultDevice,
+                              static_cast<LONG>(index % devices.size()));
+    return current();
+  }
+
+  HRESULT STDMETHODCALLTYPE EnumAudioEndpoints(EDataFlow,
+                                               DWORD,
+                                               IMMDeviceCollection**) override
+  {
+    return E_NOTIMPL;
+  }
+
+  HRESULT STDMETHODCALLTYPE GetDefaultAudioEndpoint(  //
+      EDataFlow,
+      ERole,
+      IMMDevice** ppEndpoint) override
+  {
+    auto& device = current();
+    device.AddRef();
+    *ppEndpoint = &device;
+    return S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE GetDevice(LPCWSTR pwstrId,
+                                      IMMDevice** ppDevice) override
+  {
+    for (auto* device : devices) {
+      if (device->id() == pwstrId) {
+        device->AddRef();
+        *ppDevice = device;
+        return S_OK;
+      }
+    }
+
+    *ppDevice = nullptr;
+    return E_NOTFOUND;
+  }
+
+  HRESULT STDMETHODCALLTYPE
+  RegisterEndpointNotificationCallback(IMMNotificationClient*) override
+  {
+    return E_NOTIMPL;
+  }
+
+  HRESULT STDMETHODCALLTYPE
+  UnregisterEndpointNotificationCallback(IMMNotificationClient*) override
+  {
+    return E_NOTIMPL;
+  }
+};
+
+struct BenchOptions
+{
+  LONG64 rate = 100'000;
+  LONG64 durationMs = 2'000;
+  LONG64 costUs = 50;
+  LONG64 switchRate = 0;
+  LONG64 devices = 2;
+  LONG64 settleMs = Options {}.settleMilliseconds;
+  LONG64 pollMs = 0;
+  std::wstring mmcssTask {};
+  std::wstring replayPath {};
+  bool direct = false;
+};
+
+BenchOptions ParseBenchOptions(int argc, char** argv)
+{
+  auto options = BenchOptions {};
+  auto number = [](std::string_view argument, std::string_view name)
+  {
+    argument.remove_prefix(name.size());
+    auto value = LONG64 {};
+    auto [end, error] = std::from_chars(
+        argument.data(), argument.data() + argument.size(), value);
+    if (error != std::errc() || end != argument.data() + argument.size()) {
+      throw std::runtime_error(std::format("Invalid value for {}", name));
+    }
+    return value;
+  };
+
+  for (auto i = 1; i < argc; ++i) {
+    auto argument = std::string_view(argv[i]);
+    if (argument.starts_with("--rate="sv)) {
+      options.rate = number(argument, "--rate="sv);
+    } else if (argument.starts_with("--duration="sv)) {
+      options.durationMs = number(argument, "--duration="sv);
+    } else if (argument.starts_with("--cost="sv)) {
+      options.costUs = number(argument, "--cost="sv);
+    } else if (argument.starts_with("--switch-rate="sv)) {
+      options.switchRate = number(argument, "--switch-rate="sv);
+    } else if (argument.starts_with("--devices="sv)) {
+      options.devices = std::max(number(argument, "--devices="sv), LONG64 {1});
+    } else if (argument.starts_with("--settle="sv)) {
+      options.settleMs = std::clamp(number(argument, "--settle="sv),
+                                    LONG64 {},
+                                    LONG64 {USER_TIMER_MAXIMUM});
+    } else if (argument.starts_with("--poll="sv)) {
+      options.pollMs = std::clamp(
+          number(argument, "--poll="sv), LONG64 {}, LONG64 {MAXLONG});
+    } else if (argument == "--mmcss"sv) {
+      options.mmcssTask = L"Audio";
+    } else if (argument.starts_with("--mmcss="sv)) {
+      argument.remove_prefix("--mmcss="sv.size());
+      if (argument.empty()) {
+        throw std::runtime_error("Invalid value for --mmcss=");
+      }
+      options.mmcssTask.assign(argument.begin(), argument.end());
+    } else if (argument.starts_with("--replay="sv)) {
+      argument.remove_prefix("--replay="sv.size());
+      options.replayPath.assign(argument.begin(), argument.end());
+    } else if (argument == "--direct"sv) {
+      options.direct = true;
+    } else {
+      throw std::runtime_error(std::format("Unknown argument {}", argument));
+    }
+  }
+
+  return options;
+}
+
+struct Bench
+{
+  State* state {};
+  LONG64 dispatched {};
+  LONG64 maxQueueDepth {};
+  LONG64 notifications {};
+  LONG64 switches {};
+};
+
+LRESULT CALLBACK BenchWndProc(  //
+    HWND hwnd,
+    UINT message,
+    WPARAM wParam,
+    LPARAM lParam)
+{
+  switch (message) {
+    case WM_CREATE: {
+      auto* bench = as_ptr<CREATESTRUCT>(lParam)->lpCreateParams;
+      SetLastError(0);
+      if (SetWindowLongPtrW(
+              hwnd, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(bench))
+          != 0)
+      {
+        break;
+      }
+      throwIf(GetLastError() != 0);
+      break;
+    }
+    case UserMessage::GetDefaultEndpoint:
+    case UserMessage::ChangeAudio:
+    case UserMessage::EndpointChanged: {
+      auto userData = GetWindowLongPtrW(hwnd, GWLP_USERDATA);
+      throwIf(userData == 0);
+
+      auto& bench = *as_ptr<Bench>(userData);
+      if (message == UserMessage::ChangeAudio) {
+        auto posted =
+            LONG64 {ReadAcquire(&bench.state->stats.postedChanges)};
+        bench.maxQueueDepth =
+            std::max(bench.maxQueueDepth, posted - bench.dispatched);
+        ++bench.dispatched;
+      }
+
+      HandleAudioMessage(*bench.state, hwnd, message, wParam, lParam);
+      break;
+    }
+    case WM_TIMER: {
+      auto userData = GetWindowLongPtrW(hwnd, GWLP_USERDATA);
+      throwIf(userData == 0);
+
+      HandleAudioTimer(*as_ptr<Bench>(userData)->state, hwnd, wParam);
+      break;
+    }
+    case WM_CLOSE:
+      throwIf(DestroyWindow(hwnd) == 0);
+      break;
+    case WM_DESTROY:
+      PostQuitMessage(0);
+      break;
+  }
+
+  return DefWindowProcW(hwnd, message, wParam, lParam);
+}
+
+void Produce(BenchOptions const& options,
+             Bench& bench,
+             MockDeviceEnumerator& enumerator,
+             IMMNotificationClient* notificationClient,
+             HWND window)
+{
+  auto foreign = GUID {};
+  throwIfCOM(CoCreateGuid(&foreign));
+
+  auto frequency = performanceFrequency();
+  auto ticksPer = [&](LONG64 rate)
+  { return rate > 0 ? frequency / rate : LONG64 {}; };
+  auto notifyInterval = ticksPer(options.rate);
+  auto switchInterval = ticksPer(options.switchRate);
+
+  auto start = performanceCounter();
+  auto end = start + frequency * options.durationMs / 1000;
+  auto nextNotify = start;
+  auto nextSwitch = start + switchInterval;
+  for (auto now = start; now < end; now = performanceCounter()) {
+    if (switchInterval != 0 && now >= nextSwitch) {
+      auto& device = enumerator.next();
+      (void)notificationClient->OnDefaultDeviceChanged(
+          eRender, eConsole, device.id().c_str());
+      ++bench.switches;
+      nextSwitch += switchInterval;
+    }
+
+    if (now >= nextNotify) {
+      enumerator.current().volume().fire(foreign);
+      (void)InterlockedIncrement64(&bench.notifications);
+      nextNotify += notifyInterval;
+    } else {
+      YieldProcessor();
+    }
+  }
+
+  throwIf(PostMessageW(window, WM_CLOSE, 0, 0) == 0);
+}
+
+struct Recording
+{
+  LONG64 frequency {};
+  std::vector<EventRecord> events {};
+};
+
+Recording LoadRecording(std::wstring const& path)
+{
+  auto file = CreateFileW(  //
+      path.c_str(),
+      GENERIC_READ,
+      FILE_SHARE_READ,
+      nullptr,
+      OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL,
+      nullptr);
+  throwIf(file == INVALID_HANDLE_VALUE);
+  auto fileHandle = Handle(file);
+
+  auto read = [&](void* data, std::size_t size)
+  {
+    auto bytesRead = DWORD {};
+    throwIf(ReadFile(file, data, static_cast<DWORD>(size), &bytesRead, nullptr)
+            == 0);
+    if (bytesRead != size) {
+      throw std::runtime_error("Truncated recording");
+    }
+  };
+
+  auto header = RecordingHeader {};
+  read(&header, sizeof(header));
+  if (header.magic != recordingMagic || header.version != recordingVersion
+      || header.frequency <= 0 || header.count > recorderCapacity)
+  {
+    throw std::runtime_error("Not an AlwaysMute recording");
+  }
+
+  auto recording = Recording {.frequency = header.frequency};
+  recording.events.resize(static_cast<std::size_t>(header.count));
+  read(recording.events.data(), recording.events.size() * sizeof(EventRecord));
+  return recording;
+}
+
+void Replay(Recording const& recording,
+            Bench& bench,
+            MockDeviceEnumerator& enumerator,
+            IMMNotificationClient* notificationClient,
+            HWND window)
+{
+  auto foreign = GUID {};
+  throwIfCOM(CoCreateGuid(&foreign));
+
+  auto indices = std::map<ULONG, std::size_t>();
+  auto index = [&](ULONG endpoint)
+  { return indices.try_emplace(endpoint, indices.size()).first->second; };
+
+  auto frequency = performanceFrequency();
+  auto start = performanceCounter();
+  auto origin =
+      recording.events.empty() ? LONG64 {} : recording.events.front().timestamp;
+  for (auto const& event : recording.events) {
+    auto due =
+        start + (event.timestamp - origin) * frequency / recording.frequency;
+    while (performanceCounter() < due) {
+      YieldProcessor();
+    }
+
+    switch (event.type) {
+      case EventType::Notify:
+        if ((event.flags & EventFlag::Own) == 0) {
+          enumerator.device(index(event.endpoint))
+              .volume()
+              .fire(foreign, event.master);
+          (void)InterlockedIncrement64(&bench.notifications);
+        }
+        break;
+      case EventType::DefaultChanged:
+        if (LOBYTE(event.flags) == eRender && HIBYTE(event.flags) == eConsole)
+        {
+          auto& device = enumerator.select(index(event.endpoint));
+          (void)notificationClient->OnDefaultDeviceChanged(
+              eRender, eConsole, device.id().c_str());
+          ++bench.switches;
+        }
+        break;
+    }
+  }
+
+  throwIf(PostMessageW(window, WM_CLOSE, 0, 0) == 0);
+}
+
+int TryMain(int argc, char** argv)
+{
+  auto benchOptions = ParseBenchOptions(argc, argv);
+
+  auto guid = GUID {};
+  throwIfCOM(CoCreateGuid(&guid));
+
+  auto counters = Counters {
+      .costTicks = benchOptions.costUs * performanceFrequency() / 1'000'000,
+  };
+  auto enumerator = makeComObject<MockDeviceEnumerator>(
+      static_cast<std::size_t>(benchOptions.devices), counters);
+
+  auto benchWindowClass = WNDCLASSW  //
+      {.lpfnWndProc = BenchWndProc,
+       .hInstance = GetModuleHandleW(nullptr),
+       .lpszClassName = L"AlwaysMute - Bench"};
+  auto benchAtom = RegisterClassW(&benchWindowClass);
+  throwIf(benchAtom == 0);
+
+  auto stats = Stats {};
+  auto state = State  //
+      {.guid = &guid,
+       .deviceEnumerator = enumerator.get(),
+       .options =
+           Options {
+               .direct = benchOptions.direct,
+               .settleMilliseconds = static_cast<UINT>(benchOptions.settleMs),
+               .pollMilliseconds = static_cast<UINT>(benchOptions.pollMs),
+               .mmcssTask = benchOptions.mmcssTask,
+           },
+       .stats = stats};
+  auto mmcss = MmcssRegistration(state.options.mmcssTask);
+  auto pollTimer = Handle(nullptr);
+  if (benchOptions.pollMs != 0) {
+    pollTimer.handle =
+        CreateWaitableTimerExW(nullptr, nullptr, 0, TIMER_ALL_ACCESS);
+    throwIf(pollTimer.handle == nullptr);
+    state.pollTimer = pollTimer.handle;
+  }
+  auto bench = Bench {.state = &state};
+  auto window = CreateWindowW(  //
+      MAKEINTATOM(benchAtom),
+      L"Message only",
+      0,
+      0,
+      0,
+      0,
+      0,
+      HWND_MESSAGE,
+      nullptr,
+      benchWindowClass.hInstance,
+      &bench);
+  throwIf(window == nullptr);
+
+  auto notificationClient =
+      makeComObject<NotificationClient>(window, state.options, state.stats);
+  auto recording = benchOptions.replayPath.empty()
+      ? Recording()
+      : LoadRecording(benchOptions.replayPath);
+  HandleAudioMessage(
+      state, window, UserMessage::GetDefaultEndpoint, eRender, 0);
+  auto initialCalls = ReadNoFence(&counters.enforcementCalls);
+
+  auto start = performanceCounter();
+  auto producer = std::thread(
+      [&]
+      {
+        if (!benchOptions.replayPath.empty()) {
+          Replay(recording,
+                 bench,
+                 *enumerator,
+                 notificationClient.get(),
+                 window);
+        } else {
+          Produce(benchOptions,
+                  bench,
+                  *enumerator,
+                  notificationClient.get(),
+                  window);
+        }
+      });
+
+  (void)RunMessageLoop(state, window);
+  producer.join();
+  auto elapsedUs = toMicroseconds(performanceCounter() - start);
+
+  auto notifications = ReadNoFence64(&bench.notifications);
+  auto polled = std::ranges::count_if(state.endpoints,
+                                      [](auto const& entry)
+                                      { return entry.second.polled(); });
+  std::cout << std::format(
+      "mode: {}{}{}\n"
+      "notifications: {} in {} ms ({:.0f}/s)\n"
+      "default switches: {} ({} re-resolutions avoided)\n"
+      "enforcement calls: {}\n"
+      "coalesced: {}\n"
+      "suppressed: {}\n"
+      "failures transient/permanent/retries: {}/{}/{}\n"
+      "poll corrections: {} ({} of {} endpoints still polled)\n"
+      "max queue depth: {}\n"
+      "queue latency p50/p99/max: {}/{}/{} us\n"
+      "mute latency p50/p99/max: {}/{}/{} us\n",
+      benchOptions.direct ? "direct" : "posted",
+      benchOptions.mmcssTask.empty() ? "" : ", mmcss",
+      benchOptions.replayPath.empty() ? "" : ", replay",
+      notifications,
+      elapsedUs / 1000,
+      static_cast<double>(notifications) * 1e6
+          / static_cast<double>(std::max(elapsedUs, LONG64 {1})),
+      bench.switches,
+      stats.avoidedResolutions,
+      ReadNoFence(&counters.enforcementCalls) - initialCalls,
+      ReadNoFence(&stats.coalescedNotifications),
+      ReadNoFence(&stats.suppressedCalls),
+      ReadNoFence(&stats.failures.transient),
+      ReadNoFence(&stats.failures.permanent),
+      ReadNoFence(&stats.failures.retries),
+      stats.pollCorrections,
+      benchOptions.pollMs != 0 ? polled : 0,
+      state.endpoints.size(),
+      bench.maxQueueDepth,
+      stats.queueLatency.percentile(500),
+      stats.queueLatency.percentile(990),
+      stats.queueLatency.max(),
+      stats.muteLatency.percentile(500),
+      stats.muteLatency.percentile(990),
+      stats.muteLatency.max());
+
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+  try {
+    return TryMain(argc, argv);
+  } catch (com_error const& error) {
+    std::cerr << std::system_category().message(error.code()) << '\n';
+  } catch (std::exception const& error) {
+    std::cerr << error.what() << '\n';
+  }
+
+  return 1;
+}
@@ -0,0 +1,3856 @@
+// SPDX-License-Identifier: GPL-3.0
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <cstdint>
+#include <exception>
+#include <expected>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <new>
+#include <optional>
+#include <ranges>
+#include <source_location>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifndef ALWAYSMUTE_LEAN
+#include <iostream>
+#include <stacktrace>
+#endif
+
+#include <Windows.h>
+#include <audiopolicy.h>
+#include <avrt.h>
+#include <devicetopology.h>
+#include <endpointvolume.h>
+#include <mmdeviceapi.h>
+#include <objbase.h>
+#include <psapi.h>
+#include <shellapi.h>
+
+#include <TraceLoggingProvider.h>
+#include <winmeta.h>
+
+#define PRECONDITION(x) \
+  do { \
+    if (!(x)) { \
+      throw std::runtime_error("Precondition [ " #x " ] not met"); \
+    } \
+  } while (false)
+
+#define PROPAGATE(x) \
+  do { \
+    if (auto result_ = (x); !result_) [[unlikely]] { \
+      return std::unexpected(result_.error()); \
+    } \
+  } while (false)
+
+using namespace std::string_view_literals;
+
+namespace
+{
+
+TRACELOGGING_DEFINE_PROVIDER(  //
+    traceProvider,
+    "AlwaysMute",
+    (0xa019c4a9,
+     0x0527,
+     0x4c8e,
+     0xab,
+     0x0b,
+     0xaf,
+     0x4e,
+     0xce,
+     0xa4,
+     0x8e,
+     0xd3));
+
+class com_error : public std::exception
+{
+  HRESULT _code;
+
+public:
+  explicit com_error(HRESULT code) : _code(code) {}
+
+  HRESULT code() const { return _code; }
+};
+
+void outputSystemError(DWORD error = GetLastError())
+{
+  constexpr auto bufferSize = DWORD {4096};
+  auto buffer = std::array<wchar_t, bufferSize>();
+  auto charactersWrittenWithoutNull = FormatMessageW(  //
+      FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+      nullptr,
+      error,
+      MAKELANGID(LANG_NEUTRAL, SUBLANG_NEUTRAL),
+      buffer.data(),
+      bufferSize,
+      nullptr);
+  if (charactersWrittenWithoutNull != 0) {
+    auto it = buffer.begin() + charactersWrittenWithoutNull;
+    auto tail = L"\n\0"sv;
+    if (auto distance = static_cast<std::size_t>(buffer.end() - it);
+        tail.size() > distance)
+    {
+      tail.remove_prefix(tail.size() - distance);
+    }
+    (void)std::ranges::copy(tail, it);
+    OutputDebugStringW(buffer.data());
+  } else {
+    OutputDebugStringW(L"Can't get error message\n");
+  }
+}
+
+#ifdef ALWAYSMUTE_LEAN
+constexpr auto leanBuild = true;
+#else
+constexpr auto leanBuild = false;
+#endif
+
+__declspec(noinline) void outputStacktrace()
+{
+#ifndef ALWAYSMUTE_LEAN
+  std::cerr << std::stacktrace::current(1) << '\n';
+#endif
+}
+
+__declspec(noinline) void outputFailure(std::source_location const& location)
+{
+#ifdef ALWAYSMUTE_LEAN
+  TraceLoggingWrite(traceProvider,
+                    "CheckFailed",
+                    TraceLoggingLevel(WINEVENT_LEVEL_ERROR),
+                    TraceLoggingString(location.file_name(), "File"),
+                    TraceLoggingUInt32(location.line(), "Line"),
+                    TraceLoggingString(location.function_name(), "Function"));
+  OutputDebugStringA(location.function_name());
+  OutputDebugStringA(" failed\n");
+#else
+  std::cerr << location.file_name() << '(' << location.line()
+            << "): " << location.function_name() << '\n'
+            << std::stacktrace::current(1) << '\n';
+#endif
+}
+
+[[noreturn]] void throw_(
+    DWORD error,
+    std::source_location location = std::source_location::current())
+{
+  outputFailure(location);
+  throw std::system_error(static_cast<int>(error), std::system_category());
+}
+
+void throwIf(bool condition,
+             DWORD error,
+             std::source_location location = std::source_location::current())
+{
+  if (condition) [[unlikely]] {
+    throw_(error, location);
+  }
+}
+
+void throwIf(bool condition,
+             std::source_location location = std::source_location::current())
+{
+  if (condition) [[unlikely]] {
+    throw_(GetLastError(), location);
+  }
+}
+
+[[noreturn]] void throwCOM(HRESULT result, std::source_location location)
+{
+  outputFailure(location);
+  throw com_error(result);
+}
+
+void throwIfCOM(
+    HRESULT result,
+    std::source_location location = std::source_location::current())
+{
+  if (FAILED(result)) [[unlikely]] {
+    throwCOM(result, location);
+  }
+}
+
+template<typename T = void>
+using Result = std::expected<T, HRESULT>;
+
+Result<> checkCOM(HRESULT result)
+{
+  if (FAILED(result)) [[unlikely]] {
+    return std::unexpected(result);
+  }
+
+  return {};
+}
+
+Result<> checkWin32(bool failed)
+{
+  if (failed) [[unlikely]] {
+    return std::unexpected(HRESULT_FROM_WIN32(GetLastError()));
+  }
+
+  return {};
+}
+
+template<typename T>
+T* as_ptr(auto value)
+{
+  return std::launder(reinterpret_cast<T*>(value));
+}
+
+struct UserMessage
+{
+  enum enum_ : UINT
+  {
+    TrayIcon = WM_USER,
+    AddTrayIcon,
+    GetDefaultEndpoint,
+    ChangeAudio,
+    EnumerateEndpoints,
+    EndpointChanged,
+    SessionCreated,
+    ChangeSession,
+    EnterBackground,
+    PolicyChanged,
+    HardwareMuteChanged,
+    DrainCommands,
+  };
+  static constexpr WORD TrayLicense = 1;
+  static constexpr WORD TrayExit = 2;
+  static constexpr WORD TrayResync = 3;
+  static constexpr WORD TrayRaises = 4;
+  static constexpr UINT_PTR TrayRetryTimer = 1;
+  static constexpr UINT_PTR ReloadTimer = 2;
+  static constexpr UINT_PTR SettleTimer = 3;
+  static constexpr UINT_PTR RetryTimer = 5;
+};
+
+LONG64 performanceCounter()
+{
+  auto counter = LARGE_INTEGER {};
+  (void)QueryPerformanceCounter(&counter);
+  return counter.QuadPart;
+}
+
+LONG64 performanceFrequency()
+{
+  static auto const frequency = []
+  {
+    auto frequency = LARGE_INTEGER {};
+    (void)QueryPerformanceFrequency(&frequency);
+    return frequency.QuadPart;
+  }();
+  return frequency;
+}
+
+LONG64 toMicroseconds(LONG64 ticks)
+{
+  return ticks * 1'000'000 / performanceFrequency();
+}
+
+class LatencyHistogram
+{
+  std::array<LONG, 32> buckets {};
+  LONG64 maximum {};
+  LONG64 latest {};
+
+public:
+  void add(LONG64 microseconds)
+  {
+    auto value = static_cast<std::uint64_t>(std::max(microseconds, LONG64 {}));
+    auto bucket = std::min(static_cast<std::size_t>(std::bit_width(value)),
+                           buckets.size() - 1);
+    (void)InterlockedIncrement(&buckets[bucket]);
+    WriteNoFence64(&latest, microseconds);
+
+    auto current = ReadNoFence64(&maximum);
+    while (current < microseconds) {
+      auto previous =
+          InterlockedCompareExchange64(&maximum, microseconds, current);
+      if (previous == current) {
+        break;
+      }
+      current = previous;
+    }
+  }
+
+  LONG64 percentile(LONG64 permille) const
+  {
+    auto total = LONG64 {};
+    for (auto const& bucket : buckets) {
+      total += ReadNoFence(&bucket);
+    }
+    if (total == 0) {
+      return 0;
+    }
+
+    auto threshold = (total * permille + 999) / 1000;
+    auto seen = LONG64 {};
+    for (auto i = std::size_t {}; i != buckets.size(); ++i) {
+      seen += ReadNoFence(&buckets[i]);
+      if (seen >= threshold) {
+        return std::min((LONG64 {1} << i) - 1, max());
+      }
+    }
+
+    return max();
+  }
+
+  LONG64 max() const { return ReadNoFence64(&maximum); }
+
+  LONG64 last() const { return ReadNoFence64(&latest); }
+};
+
+struct FailureCounters
+{
+  LONG transient {};
+  LONG permanent {};
+  LONG retries {};
+  HRESULT last {};
+};
+
+struct EventRecord
+{
+  LONG64 timestamp;
+  USHORT type;
+  USHORT flags;
+  ULONG endpoint;
+  float master;
+  float level;
+};
+
+struct EventType
+{
+  enum enum_ : USHORT
+  {
+    Notify,
+    DefaultChanged,
+    Enforce,
+  };
+};
+
+struct EventFlag
+{
+  enum enum_ : USHORT
+  {
+    Own = 1,
+    Direct = 2,
+    Hardware = 4,
+  };
+};
+
+struct RecordingHeader
+{
+  ULONG magic;
+  ULONG version;
+  LONG64 frequency;
+  ULONG64 count;
+};
+
+constexpr auto recordingMagic = ULONG {0x43524D41};
+constexpr auto recordingVersion = ULONG {1};
+constexpr auto recorderCapacity = std::size_t {16384};
+
+ULONG EndpointKey(std::wstring_view id)
+{
+  auto hash = ULONG {2166136261};
+  for (auto c : id) {
+    hash = (hash ^ c) * ULONG {16777619};
+  }
+  return hash;
+}
+
+// A slot is valid once its commit word holds its position plus one.
+class EventRecorder
+{
+  std::unique_ptr<EventRecord[]> _records;
+  std::unique_ptr<LONG64[]> _commits;
+  LONG64 _next {};
+
+public:
+  EventRecorder()
+      : _records(std::make_unique_for_overwrite<EventRecord[]>(
+            recorderCapacity))
+      , _commits(std::make_unique<LONG64[]>(recorderCapacity))
+  {
+  }
+
+  EventRecorder(EventRecorder&&) = delete;
+
+  void record(USHORT type,
+              USHORT flags,
+              ULONG endpoint,
+              float master,
+              float level)
+  {
+    auto slot = InterlockedIncrement64(&_next) - 1;
+    auto index = static_cast<std::size_t>(slot) % recorderCapacity;
+    (void)InterlockedExchange64(&_commits[index], 0);
+    _records[index] = EventRecord {
+        .timestamp = performanceCounter(),
+        .type = type,
+        .flags = flags,
+        .endpoint = endpoint,
+        .master = master,
+        .level = level,
+    };
+    WriteRelease64(&_commits[index], slot + 1);
+  }
+
+  std::vector<EventRecord> snapshot() const
+  {
+    auto next = ReadAcquire64(&_next);
+    auto first = std::max(next - LONG64 {recorderCapacity}, LONG64 {});
+    auto records = std::vector<EventRecord>();
+    records.reserve(static_cast<std::size_t>(next - first));
+    for (auto slot = first; slot != next; ++slot) {
+      auto index = static_cast<std::size_t>(slot) % recorderCapacity;
+      auto before = ReadAcquire64(&_commits[index]);
+      auto record = _records[index];
+      MemoryBarrier();
+      if (before == slot + 1 && ReadNoFence64(&_commits[index]) == before) {
+        records.push_back(record);
+      }
+    }
+
+    return records;
+  }
+};
+
+struct ProcessRaises
+{
+  DWORD processId;
+  LONG raises;
+};
+
+constexpr auto attributionCapacity = std::size_t {8};
+
+constexpr auto sharedStatsVersion = LONG {2};
+
+// Readers retry while sequence is odd or changes across their copy.
+struct SharedStats
+{
+  LONG version;
+  LONG sequence;
+  LONG notifications;
+  LONG enforcementCalls;
+  LONG suppressedCalls;
+  LONG coalescedNotifications;
+  LONG64 queueLatencyMicroseconds;
+  LONG64 muteLatencyMicroseconds;
+  std::array<wchar_t, 256> endpointId;
+  std::array<ProcessRaises, attributionCapacity> raises;
+};
+
+struct Stats
+{
+  LONG notifications {};
+  LONG enforcementCalls {};
+  LONG coalescedNotifications {};
+  LONG postedChanges {};
+  LatencyHistogram queueLatency {};
+  LatencyHistogram muteLatency {};
+  LONG64 firstMuteMicroseconds {};
+  LONG avoidedResolutions {};
+  LONG suppressedCalls {};
+  LONG pollCorrections {};
+  FailureCounters failures {};
+  std::array<ProcessRaises, attributionCapacity> raises {};
+  SharedStats* shared {};
+  EventRecorder* recorder {};
+
+  template<typename F>
+  void update(F&& write)
+  {
+    if (shared == nullptr) {
+      return;
+    }
+
+    auto sequence = ReadNoFence(&shared->sequence);
+    while ((sequence & 1) != 0
+           || InterlockedCompareExchange(
+                  &shared->sequence, sequence | 1, sequence)
+               != sequence)
+    {
+      (void)SwitchToThread();
+      sequence = ReadNoFence(&shared->sequence);
+    }
+
+    write(*shared);
+
+    (void)InterlockedExchange(
+        &shared->sequence,
+        static_cast<LONG>(static_cast<ULONG>(sequence) + 2));
+  }
+
+  void capture(USHORT type,
+               USHORT flags,
+               ULONG endpoint,
+               float master,
+               float level)
+  {
+    if (recorder != nullptr) {
+      recorder->record(type, flags, endpoint, master, level);
+    }
+  }
+
+  void record(LONG64 notifiedAt, LONG64 dispatchedAt, LONG64 returnedAt)
+  {
+    queueLatency.add(toMicroseconds(dispatchedAt - notifiedAt));
+    muteLatency.add(toMicroseconds(returnedAt - dispatchedAt));
+  }
+
+  void publish(std::optional<std::wstring_view> endpointId = {})
+  {
+    update(
+        [&](SharedStats& target)
+        {
+          WriteNoFence(&target.notifications, ReadNoFence(&notifications));
+          WriteNoFence(&target.enforcementCalls,
+                       ReadNoFence(&enforcementCalls));
+          WriteNoFence(&target.suppressedCalls, ReadNoFence(&suppressedCalls));
+          WriteNoFence(&target.coalescedNotifications,
+                       ReadNoFence(&coalescedNotifications));
+          WriteNoFence64(&target.queueLatencyMicroseconds,
+                         queueLatency.last());
+          WriteNoFence64(&target.muteLatencyMicroseconds, muteLatency.last());
+          if (endpointId.has_value()) {
+            auto id = endpointId->substr(0, target.endpointId.size() - 1);
+            auto out = std::ranges::copy(id, target.endpointId.begin()).out;
+            std::ranges::fill(out, target.endpointId.end(), L'\0');
+          }
+        });
+  }
+
+  // The entry with the fewest raises makes room for a new process.
+  void attribute(DWORD processId, LONG count)
+  {
+    auto byProcess = [&](ProcessRaises const& entry)
+    { return entry.processId == processId && entry.raises != 0; };
+    auto it = std::ranges::find_if(raises, byProcess);
+    if (it == raises.end()) {
+      it = std::ranges::min_element(raises, {}, &ProcessRaises::raises);
+      WriteNoFence(&it->raises, 0);
+      it->processId = processId;
+    }
+
+    WriteNoFence(&it->raises, ReadNoFence(&it->raises) + count);
+  }
+
+  void publishRaises()
+  {
+    update([&](SharedStats& target)
+           { (void)std::ranges::copy(raises, target.raises.begin()); });
+  }
+};
+
+enum class RemoteCommand : ULONG_PTR
+{
+  None,
+  Pause,
+  Resume,
+  Query,
+  Dump,
+  Resync,
+  Stop,
+};
+
+struct RemoteReply
+{
+  enum enum_ : LRESULT
+  {
+    Rejected,
+    Enforcing,
+    Paused,
+  };
+};
+
+struct Options
+{
+  bool allEndpoints {};
+  bool direct {};
+  bool sessions {};
+  bool background {};
+  bool global {};
+  bool capture {};
+  bool channels {};
+  bool topology {};
+  UINT settleMilliseconds {250};
+  UINT pollMilliseconds {};
+  std::wstring mmcssTask {};
+  std::wstring configPath {};
+  std::wstring recordPath {};
+  RemoteCommand command {};
+};
+
+struct LocalDeleter
+{
+  void operator()(void* ptr) { (void)LocalFree(ptr); }
+};
+
+struct CoTaskMemDeleter
+{
+  void operator()(void* ptr) { CoTaskMemFree(ptr); }
+};
+
+template<typename T>
+using CoTaskMemPtr = std::unique_ptr<T, CoTaskMemDeleter>;
+
+Options ParseOptions()
+{
+  auto argc = 0;
+  auto argv = std::unique_ptr<LPWSTR, LocalDeleter>(
+      CommandLineToArgvW(GetCommandLineW(), &argc));
+  throwIf(argv == nullptr);
+
+  auto arguments = std::span(argv.get(), static_cast<std::size_t>(argc));
+  auto options = Options {};
+  auto milliseconds = [](std::wstring_view argument, std::wstring_view name)
+  {
+    argument.remove_prefix(name.size());
+    if (argument.empty()) {
+      throw std::runtime_error("Invalid command line argument value");
+    }
+
+    auto value = UINT {};
+    for (auto digit : argument) {
+      if (digit < L'0' || L'9' < digit || value > USER_TIMER_MAXIMUM / 10) {
+        throw std::runtime_error("Invalid command line argument value");
+      }
+      value = value * 10 + static_cast<UINT>(digit - L'0');
+    }
+    return value;
+  };
+
+  for (auto* argument : arguments | std::views::drop(1)) {
+    if (argument == L"--all-endpoints"sv) {
+      options.allEndpoints = true;
+    } else if (argument == L"--direct"sv) {
+      options.direct = true;
+    } else if (argument == L"--sessions"sv) {
+      options.sessions = true;
+    } else if (argument == L"--background"sv) {
+      options.background = true;
+    } else if (argument == L"--global"sv) {
+      options.global = true;
+    } else if (argument == L"--capture"sv) {
+      options.capture = true;
+    } else if (argument == L"--channels"sv) {
+      options.channels = true;
+    } else if (argument == L"--topology"sv) {
+      options.topology = true;
+    } else if (std::wstring_view(argument).starts_with(L"--settle="sv)) {
+      options.settleMilliseconds = milliseconds(argument, L"--settle="sv);
+    } else if (std::wstring_view(argument).starts_with(L"--poll="sv)) {
+      options.pollMilliseconds = milliseconds(argument, L"--poll="sv);
+    } else if (argument == L"--mmcss"sv) {
+      options.mmcssTask = L"Audio";
+    } else if (std::wstring_view(argument).starts_with(L"--mmcss="sv)) {
+      options.mmcssTask = argument + L"--mmcss="sv.size();
+      if (options.mmcssTask.empty()) {
+        throw std::runtime_error("Invalid command line argument value");
+      }
+    } else if (std::wstring_view(argument).starts_with(L"--config="sv)) {
+      options.configPath = argument + L"--config="sv.size();
+    } else if (argument == L"--pause"sv) {
+      options.command = RemoteCommand::Pause;
+    } else if (argument == L"--resume"sv) {
+      options.command = RemoteCommand::Resume;
+    } else if (argument == L"--query"sv) {
+      options.command = RemoteCommand::Query;
+    } else if (argument == L"--resync"sv) {
+      options.command = RemoteCommand::Resync;
+    } else if (argument == L"--dump"sv) {
+      options.command = RemoteCommand::Dump;
+    } else if (std::wstring_view(argument).starts_with(L"--record="sv)) {
+      options.recordPath = argument + L"--record="sv.size();
+    } else {
+      throw std::runtime_error("Unknown command line argument");
+    }
+  }
+
+  if (options.background && !options.mmcssTask.empty()) {
+    throw std::runtime_error("--background and --mmcss are exclusive");
+  }
+
+  return options;
+}
+
+bool IsEnforcedFlow(Options const& options, EDataFlow flow)
+{
+  return flow == eRender || (flow == eCapture && options.capture);
+}
+
+LPCWSTR InstanceMutexName(Options const& options)
+{
+  return options.global ? L"Global\\AlwaysMute" : L"Local\\AlwaysMute";
+}
+
+LPCWSTR StatsMappingName(Options const& options)
+{
+  return options.global ? L"Global\\AlwaysMute.Stats"
+                        : L"Local\\AlwaysMute.Stats";
+}
+
+constexpr auto audioClassName = L"AlwaysMute - Audio";
+constexpr auto remoteCommandMilliseconds = UINT {1000};
+
+int SendRemoteCommand(RemoteCommand command)
+{
+  auto window = FindWindowExW(HWND_MESSAGE, nullptr, audioClassName, nullptr);
+  if (window == nullptr) {
+    return 1;
+  }
+
+  auto data = COPYDATASTRUCT {.dwData = std::to_underlying(command)};
+  auto reply = DWORD_PTR {};
+  if (SendMessageTimeoutW(window,
+                          WM_COPYDATA,
+                          0,
+                          reinterpret_cast<LPARAM>(&data),
+                          SMTO_ABORTIFHUNG | SMTO_ERRORONEXIT,
+                          remoteCommandMilliseconds,
+                          &reply)
+      == 0)
+  {
+    return 1;
+  }
+
+  switch (reply) {
+    case RemoteReply::Enforcing:
+      return 0;
+    case RemoteReply::Paused:
+      return command == RemoteCommand::Query ? 2 : 0;
+  }
+
+  return 1;
+}
+
+template<typename Derived, typename Base>
+concept DerivedFrom = std::is_base_of_v<Base, Derived>;
+
+struct ComPtrDeleter
+{
+  void operator()(IUnknown* ptr)
+  {
+    if (ptr != nullptr) {
+      ptr->Release();
+    }
+  }
+};
+
+template<DerivedFrom<IUnknown> T>
+using ComPtr = std::unique_ptr<T, ComPtrDeleter>;
+
+template<DerivedFrom<IUnknown> T, typename... Args>
+ComPtr<T> makeComObject(Args&&... args)
+{
+  auto object = ComPtr<T>(new T(std::forward<Args>(args)...));
+  object->AddRef();
+  return object;
+}
+
+struct Handle
+{
+  HANDLE handle {};
+
+  explicit Handle(HANDLE handle)
+      : handle(handle)
+  {
+  }
+
+  Handle(Handle&&) = delete;
+
+  ~Handle()
+  {
+    if (handle != nullptr && CloseHandle(handle) == 0) {
+      outputStacktrace();
+      outputSystemError();
+    }
+  }
+};
+
+struct Library
+{
+  HINSTANCE library {};
+
+  explicit Library(LPCWSTR name)
+      : library(LoadLibraryW(name))
+  {
+    throwIf(library == nullptr);
+  }
+
+  Library(Library&&) = delete;
+
+  ~Library()
+  {
+    if (library != nullptr && FreeLibrary(library) == 0) {
+      outputStacktrace();
+      outputSystemError();
+    }
+  }
+};
+
+struct MemoryUsage
+{
+  SIZE_T privateBytes {};
+  SIZE_T workingSet {};
+};
+
+Result<MemoryUsage> QueryMemoryUsage()
+{
+  auto counters = PROCESS_MEMORY_COUNTERS_EX {};
+  PROPAGATE(checkWin32(
+      GetProcessMemoryInfo(
+          GetCurrentProcess(),
+          reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&counters),
+          sizeof(counters))
+      == 0));
+  return MemoryUsage {counters.PrivateUsage, counters.WorkingSetSize};
+}
+
+Result<> SetThreadThrottling(bool enabled)
+{
+  auto throttling = THREAD_POWER_THROTTLING_STATE {
+      .Version = THREAD_POWER_THROTTLING_CURRENT_VERSION,
+      .ControlMask = THREAD_POWER_THROTTLING_EXECUTION_SPEED,
+      .StateMask = enabled ? THREAD_POWER_THROTTLING_EXECUTION_SPEED : 0UL,
+  };
+  PROPAGATE(checkWin32(SetThreadInformation(GetCurrentThread(),
+                                            ThreadPowerThrottling,
+                                            &throttling,
+                                            sizeof(throttling))
+                       == 0));
+  return checkWin32(SetThreadPriority(GetCurrentThread(),
+                                      enabled ? THREAD_MODE_BACKGROUND_BEGIN
+                                              : THREAD_MODE_BACKGROUND_END)
+                    == 0);
+}
+
+class ThreadBoost
+{
+  bool* inBackground {};
+
+public:
+  explicit ThreadBoost(bool& inBackground)
+  {
+    if (inBackground && SetThreadThrottling(false)) {
+      this->inBackground = &inBackground;
+    }
+  }
+
+  ThreadBoost(ThreadBoost&&) = delete;
+
+  ~ThreadBoost()
+  {
+    if (inBackground == nullptr) {
+      return;
+    }
+
+    if (!SetThreadThrottling(true)) {
+      *inBackground = false;
+      outputStacktrace();
+      OutputDebugStringW(L"SetThreadThrottling failed\n");
+    }
+  }
+};
+
+Result<> EnterBackground(bool& inBackground)
+{
+  auto before = QueryMemoryUsage();
+  PROPAGATE(before);
+
+  auto throttling = PROCESS_POWER_THROTTLING_STATE {
+      .Version = PROCESS_POWER_THROTTLING_CURRENT_VERSION,
+      .ControlMask = PROCESS_POWER_THROTTLING_EXECUTION_SPEED,
+      .StateMask = PROCESS_POWER_THROTTLING_EXECUTION_SPEED,
+  };
+  PROPAGATE(checkWin32(SetProcessInformation(GetCurrentProcess(),
+                                             ProcessPowerThrottling,
+                                             &throttling,
+                                             sizeof(throttling))
+                       == 0));
+
+  auto memoryPriority =
+      MEMORY_PRIORITY_INFORMATION {.MemoryPriority = MEMORY_PRIORITY_LOW};
+  PROPAGATE(checkWin32(SetProcessInformation(GetCurrentProcess(),
+                                             ProcessMemoryPriority,
+                                             &memoryPriority,
+                                             sizeof(memoryPriority))
+                       == 0));
+
+  PROPAGATE(SetThreadThrottling(true));
+  inBackground = true;
+  PROPAGATE(checkWin32(EmptyWorkingSet(GetCurrentProcess()) == 0));
+
+  auto after = QueryMemoryUsage();
+  PROPAGATE(after);
+  TraceLoggingWrite(
+      traceProvider,
+      "EnterBackground",
+      TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+      TraceLoggingUInt64(before->privateBytes, "PrivateBytesBefore"),
+      TraceLoggingUInt64(before->workingSet, "WorkingSetBefore"),
+      TraceLoggingUInt64(after->privateBytes, "PrivateBytesAfter"),
+      TraceLoggingUInt64(after->workingSet, "WorkingSetAfter"));
+  return {};
+}
+
+struct TraceRegistration
+{
+  TraceRegistration() { throwIfCOM(TraceLoggingRegister(traceProvider)); }
+
+  TraceRegistration(TraceRegistration&&) = delete;
+
+  ~TraceRegistration() { TraceLoggingUnregister(traceProvider); }
+};
+
+class MmcssRegistration
+{
+  HANDLE handle {};
+
+public:
+  explicit MmcssRegistration(std::wstring const& task)
+  {
+    if (task.empty()) {
+      return;
+    }
+
+    auto taskIndex = DWORD {};
+    handle = AvSetMmThreadCharacteristicsW(task.c_str(), &taskIndex);
+    throwIf(handle == nullptr);
+    TraceLoggingWrite(traceProvider,
+                      "MmcssRegistered",
+                      TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+                      TraceLoggingWideString(task.c_str(), "Task"),
+                      TraceLoggingUInt32(taskIndex, "TaskIndex"));
+  }
+
+  MmcssRegistration(MmcssRegistration&&) = delete;
+
+  ~MmcssRegistration()
+  {
+    if (handle != nullptr && AvRevertMmThreadCharacteristics(handle) == FALSE)
+    {
+      outputStacktrace();
+      outputSystemError();
+    }
+  }
+};
+
+struct Policy
+{
+  bool ignore {};
+  float level {};
+};
+
+struct MappedViewDeleter
+{
+  void operator()(void const* ptr) { (void)UnmapViewOfFile(ptr); }
+};
+
+class StatsBlock
+{
+  Handle _mapping;
+  std::unique_ptr<SharedStats, MappedViewDeleter> _view;
+
+public:
+  explicit StatsBlock(Options const& options)
+      : _mapping(CreateFileMappingW(INVALID_HANDLE_VALUE,
+                                    nullptr,
+                                    PAGE_READWRITE,
+                                    0,
+                                    sizeof(SharedStats),
+                                    StatsMappingName(options)))
+  {
+    if (_mapping.handle == nullptr) {
+      TraceLoggingWrite(traceProvider,
+                        "StatsBlockUnavailable",
+                        TraceLoggingLevel(WINEVENT_LEVEL_WARNING),
+                        TraceLoggingWinError(GetLastError(), "Error"));
+      return;
+    }
+
+    auto existed = GetLastError() == ERROR_ALREADY_EXISTS;
+    _view.reset(static_cast<SharedStats*>(MapViewOfFile(
+        _mapping.handle, FILE_MAP_WRITE, 0, 0, sizeof(SharedStats))));
+    throwIf(_view == nullptr);
+    if (existed) {
+      (void)InterlockedExchange(&_view->sequence, 0);
+    }
+    (void)InterlockedExchange(&_view->version, sharedStatsVersion);
+  }
+
+  StatsBlock(StatsBlock&&) = delete;
+
+  SharedStats* get() const { return _view.get(); }
+};
+
+Result<> DumpRecording(EventRecorder const& recorder, std::wstring const& path)
+{
+  auto file = CreateFileW(  //
+      path.c_str(),
+      GENERIC_WRITE,
+      FILE_SHARE_READ,
+      nullptr,
+      CREATE_ALWAYS,
+      FILE_ATTRIBUTE_NORMAL,
+      nullptr);
+  PROPAGATE(checkWin32(file == INVALID_HANDLE_VALUE));
+  auto fileHandle = Handle(file);
+
+  auto write = [&](void const* data, std::size_t size)
+  {
+    auto written = DWORD {};
+    return checkWin32(
+        WriteFile(file, data, static_cast<DWORD>(size), &written, nullptr)
+        == 0);
+  };
+  auto records = recorder.snapshot();
+  auto header = RecordingHeader {
+      .magic = recordingMagic,
+      .version = recordingVersion,
+      .frequency = performanceFrequency(),
+      .count = records.size(),
+  };
+  auto result = write(&header, sizeof(header));
+  if (result) {
+    result = write(records.data(), records.size() * sizeof(EventRecord));
+  }
+  TraceLoggingWrite(traceProvider,
+                    "DumpRecording",
+                    TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+                    TraceLoggingWideString(path.c_str(), "Path"),
+                    TraceLoggingUInt64(header.count, "Records"),
+                    TraceLoggingHResult(result.error_or(S_OK), "Result"));
+  return result;
+}
+
+bool lessIgnoreCase(std::wstring_view left, std::wstring_view right)
+{
+  return CompareStringOrdinal(left.data(),
+                              static_cast<int>(left.size()),
+                              right.data(),
+                              static_cast<int>(right.size()),
+                              TRUE)
+      == CSTR_LESS_THAN;
+}
+
+class PolicyTable
+{
+  struct Entry
+  {
+    std::size_t offset {};
+    std::size_t size {};
+    Policy policy {};
+  };
+
+  std::wstring _ids {};
+  std::vector<Entry> _entries {};
+  Policy _fallback {};
+
+  std::wstring_view id(Entry const& entry) const
+  {
+    return std::wstring_view(_ids).substr(entry.offset, entry.size);
+  }
+
+  static std::string_view trim(std::string_view text)
+  {
+    auto first = text.find_first_not_of(" \t\r");
+    if (first == std::string_view::npos) {
+      return {};
+    }
+
+    return text.substr(first, text.find_last_not_of(" \t\r") - first + 1);
+  }
+
+  static Policy parsePolicy(std::string_view value)
+  {
+    if (value == "mute"sv) {
+      return {};
+    }
+
+    if (value == "ignore"sv) {
+      return {.ignore = true};
+    }
+
+    auto level = float {};
+    auto [end, error] =
+        std::from_chars(value.data(), value.data() + value.size(), level);
+    if (error != std::errc() || end != value.data() + value.size()
+        || !(0.0f <= level && level <= 1.0f))
+    {
+      throw std::runtime_error("Invalid policy in configuration");
+    }
+
+    return {.level = level};
+  }
+
+  void add(std::string_view id, Policy policy)
+  {
+    if (id == "*"sv) {
+      _fallback = policy;
+      return;
+    }
+
+    if (id.empty()) {
+      throw std::runtime_error("Missing endpoint in configuration");
+    }
+
+    auto size = MultiByteToWideChar(CP_UTF8,
+                                    MB_ERR_INVALID_CHARS,
+                                    id.data(),
+                                    static_cast<int>(id.size()),
+                                    nullptr,
+                                    0);
+    throwIf(size == 0);
+
+    auto offset = _ids.size();
+    _ids.resize(offset + static_cast<std::size_t>(size));
+    throwIf(MultiByteToWideChar(CP_UTF8,
+                                MB_ERR_INVALID_CHARS,
+                                id.data(),
+                                static_cast<int>(id.size()),
+                                _ids.data() + offset,
+                                size)
+            == 0);
+    _entries.push_back({offset, static_cast<std::size_t>(size), policy});
+  }
+
+public:
+  PolicyTable() = default;
+
+  explicit PolicyTable(std::string_view text)
+  {
+    if (text.starts_with("\xEF\xBB\xBF"sv)) {
+      text.remove_prefix(3);
+    }
+
+    while (!text.empty()) {
+      auto end = text.find('\n');
+      auto line = trim(text.substr(0, end));
+      text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+      if (line.empty() || line.starts_with('#')) {
+        continue;
+      }
+
+      auto separator = line.find('=');
+      if (separator == std::string_view::npos) {
+        throw std::runtime_error("Missing '=' in configuration");
+      }
+
+      add(trim(line.substr(0, separator)),
+          parsePolicy(trim(line.substr(separator + 1))));
+    }
+
+    _ids.shrink_to_fit();
+    _entries.shrink_to_fit();
+
+    auto byId = [this](Entry const& left, Entry const& right)
+    { return lessIgnoreCase(id(left), id(right)); };
+    std::ranges::sort(_entries, byId);
+
+    auto same = [&](Entry const& left, Entry const& right)
+    { return !byId(left, right); };
+    if (std::ranges::adjacent_find(_entries, same) != _entries.end()) {
+      throw std::runtime_error("Duplicate endpoint in configuration");
+    }
+  }
+
+  Policy find(std::wstring_view key) const
+  {
+    auto project = [this](Entry const& entry) { return id(entry); };
+    auto it = std::ranges::lower_bound(_entries, key, lessIgnoreCase, project);
+    if (it == _entries.end() || lessIgnoreCase(key, id(*it))) {
+      return _fallback;
+    }
+
+    return it->policy;
+  }
+
+  std::size_t size() const { return _entries.size(); }
+};
+
+struct ChangeNotification
+{
+  HANDLE handle {};
+
+  explicit ChangeNotification(HANDLE handle)
+      : handle(handle)
+  {
+  }
+
+  ChangeNotification(ChangeNotification&&) = delete;
+
+  ~ChangeNotification()
+  {
+    if (handle != INVALID_HANDLE_VALUE
+        && FindCloseChangeNotification(handle) == 0)
+    {
+      outputStacktrace();
+      outputSystemError();
+    }
+  }
+};
+
+class PolicyWatcher
+{
+  ChangeNotification change {INVALID_HANDLE_VALUE};
+  HANDLE wait {};
+  HWND window {};
+
+  static void CALLBACK onChange(PVOID context, BOOLEAN)
+  {
+    auto* watcher = static_cast<PolicyWatcher*>(context);
+    (void)PostMessageW(watcher->window, UserMessage::PolicyChanged, 0, 0);
+    (void)FindNextChangeNotification(watcher->change.handle);
+  }
+
+public:
+  PolicyWatcher(std::wstring const& path, HWND window)
+      : window(window)
+  {
+    if (path.empty()) {
+      return;
+    }
+
+    auto directory = std::wstring(L".");
+    if (auto separator = path.find_last_of(L"\\/");
+        separator != std::wstring::npos)
+    {
+      auto root = separator == 0 || path[separator - 1] == L':';
+      directory = path.substr(0, root ? separator + 1 : separator);
+    }
+    change.handle = FindFirstChangeNotificationW(
+        directory.c_str(),
+        FALSE,
+        FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE
+            | FILE_NOTIFY_CHANGE_LAST_WRITE);
+    throwIf(change.handle == INVALID_HANDLE_VALUE);
+    // The wait thread runs one callback at a time, so a change is re-armed
+    // before the next one can be reported.
+    throwIf(RegisterWaitForSingleObject(&wait,
+                                        change.handle,
+                                        onChange,
+                                        this,
+                                        INFINITE,
+                                        WT_EXECUTEINWAITTHREAD)
+            == 0);
+  }
+
+  PolicyWatcher(PolicyWatcher&&) = delete;
+
+  ~PolicyWatcher()
+  {
+    if (wait != nullptr && UnregisterWaitEx(wait, INVALID_HANDLE_VALUE) == 0) {
+      outputStacktrace();
+      outputSystemError();
+    }
+  }
+};
+
+PolicyTable LoadPolicyTable(std::wstring const& path)
+{
+  if (path.empty()) {
+    return PolicyTable();
+  }
+
+  auto file = CreateFileW(  //
+      path.c_str(),
+      GENERIC_READ,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+      nullptr,
+      OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL,
+      nullptr);
+  throwIf(file == INVALID_HANDLE_VALUE);
+  auto fileHandle = Handle(file);
+
+  auto size = LARGE_INTEGER {};
+  throwIf(GetFileSizeEx(file, &size) == 0);
+  if (size.QuadPart == 0) {
+    return PolicyTable();
+  }
+
+  auto mapping =
+      Handle(CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr));
+  throwIf(mapping.handle == nullptr);
+
+  auto view = std::unique_ptr<void const, MappedViewDeleter>(
+      MapViewOfFile(mapping.handle, FILE_MAP_READ, 0, 0, 0));
+  throwIf(view == nullptr);
+
+  auto table = PolicyTable(
+      std::string_view(static_cast<char const*>(view.get()),
+                       static_cast<std::size_t>(size.QuadPart)));
+  TraceLoggingWrite(traceProvider,
+                    "LoadPolicyTable",
+                    TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+                    TraceLoggingWideString(path.c_str(), "Path"),
+                    TraceLoggingUInt64(table.size(), "Entries"));
+  return table;
+}
+
+constexpr auto trackedChannels = UINT {64};
+
+ULONG64 OffendingChannels(std::span<float const> volumes, float level)
+{
+  auto mask = ULONG64 {};
+  auto count = std::min(volumes.size(), std::size_t {trackedChannels});
+  for (auto i = std::size_t {}; i != count; ++i) {
+    mask |= ULONG64 {volumes[i] > level} << i;
+  }
+
+  auto rest = ULONG64 {};
+  for (auto volume : volumes | std::views::drop(count)) {
+    rest |= ULONG64 {volume > level};
+  }
+  return mask | rest << (trackedChannels - 1);
+}
+
+HRESULT SetChannelLevels(IAudioEndpointVolume* volume,
+                         ULONG64 channels,
+                         float level,
+                         LPCGUID context,
+                         bool recheck)
+{
+  auto count = UINT {trackedChannels};
+  if (channels >> (trackedChannels - 1) != 0) {
+    if (auto result = volume->GetChannelCount(&count); FAILED(result)) {
+      return result;
+    }
+  }
+
+  for (; channels != 0; channels &= channels - 1) {
+    auto channel = static_cast<UINT>(std::countr_zero(channels));
+    auto last = channel == trackedChannels - 1 ? count : channel + 1;
+    for (; channel < last; ++channel) {
+      auto current = float {};
+      if (recheck) {
+        if (auto result =
+                volume->GetChannelVolumeLevelScalar(channel, &current);
+            FAILED(result))
+        {
+          return result;
+        }
+        if (current <= level) {
+          continue;
+        }
+      }
+      if (auto result =
+              volume->SetChannelVolumeLevelScalar(channel, level, context);
+          FAILED(result))
+      {
+        return result;
+      }
+    }
+  }
+
+  return S_OK;
+}
+
+// Setting the master volume rescales the channels, so the channels that
+// were offending before are checked again afterwards.
+HRESULT EnforceLevel(IAudioEndpointVolume* volume,
+                     bool master,
+                     ULONG64 channels,
+                     float level,
+                     LPCGUID context)
+{
+  if (master) {
+    if (auto result = volume->SetMasterVolumeLevelScalar(level, context);
+        FAILED(result))
+    {
+      return result;
+    }
+  }
+
+  return SetChannelLevels(volume, channels, level, context, master);
+}
+
+using ActiveSessions =
+    std::vector<std::pair<DWORD, ComPtr<IAudioSessionControl2>>>;
+
+struct RaiseSlot
+{
+  LONG processId;
+  LONG raises;
+};
+
+class EndpointHandler : public IAudioEndpointVolumeCallback
+{
+  ULONG refCount {};
+  LONG pending {};
+  LONG64 notifiedAt {};
+  LONG directRequests {};
+  LONG readers {};
+  PVOID target {};
+  GUID* guid {};
+  HWND window {};
+  Options const* options {};
+  Stats* stats {};
+  LONG level {};
+  LONG observed {
+      std::bit_cast<LONG>(std::numeric_limits<float>::infinity())};
+  LONG deliveries {};
+  LONG64 channels {};
+  PVOID sessions {};
+  std::array<RaiseSlot, attributionCapacity> raiseSlots {};
+  LONG unattributedRaises {};
+  ULONG key {};
+
+  virtual ~EndpointHandler() {}
+
+  void enter() { (void)InterlockedIncrement(&readers); }
+
+  void leave()
+  {
+    if (InterlockedDecrement(&readers) == 0) {
+      WakeByAddressAll(&readers);
+    }
+  }
+
+  void quiesce()
+  {
+    for (auto current = ReadAcquire(&readers); current != 0;
+         current = ReadAcquire(&readers))
+    {
+      (void)WaitOnAddress(&readers, &current, sizeof(current), INFINITE);
+    }
+  }
+
+  void countRaise(DWORD processId)
+  {
+    auto id = static_cast<LONG>(processId);
+    for (auto& slot : raiseSlots) {
+      auto current = ReadNoFence(&slot.processId);
+      if (current == 0) {
+        current = InterlockedCompareExchange(&slot.processId, id, 0);
+        current = current == 0 ? id : current;
+      }
+      if (current == id) {
+        (void)InterlockedIncrement(&slot.raises);
+        return;
+      }
+    }
+
+    (void)InterlockedIncrement(&unattributedRaises);
+  }
+
+  // Sessions are only published once someone has asked for attribution.
+  void attributeRaise()
+  {
+    enter();
+    auto attributed = false;
+    if (auto const* active =
+            static_cast<ActiveSessions const*>(ReadPointerAcquire(&sessions));
+        active != nullptr)
+    {
+      for (auto const& [processId, control] : *active) {
+        auto state = AudioSessionState {};
+        if (processId != 0 && SUCCEEDED(control->GetState(&state))
+            && state == AudioSessionStateActive)
+        {
+          countRaise(processId);
+          attributed = true;
+        }
+      }
+    }
+    leave();
+
+    if (!attributed) {
+      (void)InterlockedIncrement(&unattributedRaises);
+    }
+  }
+
+  float currentLevel() { return std::bit_cast<float>(ReadNoFence(&level)); }
+
+  HRESULT enforceDirectly(LONG64 arrivedAt)
+  {
+    if (InterlockedIncrement(&directRequests) != 1) {
+      (void)InterlockedIncrement(&stats->coalescedNotifications);
+      return S_OK;
+    }
+
+    enter();
+    auto* volume =
+        static_cast<IAudioEndpointVolume*>(ReadPointerAcquire(&target));
+    auto result = S_OK;
+    auto handled = LONG {1};
+    do {
+      if (volume != nullptr) {
+        auto dispatchedAt = performanceCounter();
+        auto limit = currentLevel();
+        auto offending = takeChannels();
+        result = EnforceLevel(volume,
+                              observedLevel() > limit || offending == 0,
+                              offending,
+                              limit,
+                              guid);
+        (void)InterlockedIncrement(&stats->enforcementCalls);
+        stats->capture(
+            EventType::Enforce, EventFlag::Direct, key, observedLevel(), limit);
+        stats->record(arrivedAt, dispatchedAt, performanceCounter());
+        TraceLoggingWrite(traceProvider,
+                          "ChangeAudio",
+                          TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                          TraceLoggingPointer(volume, "Endpoint"),
+                          TraceLoggingBool(true, "Direct"),
+                          TraceLoggingHResult(result, "Result"));
+        arrivedAt = dispatchedAt;
+      }
+      handled = InterlockedAdd(&directRequests, -handled);
+    } while (handled != 0);
+    leave();
+    stats->publish();
+
+    return result;
+  }
+
+public:
+  EndpointHandler(GUID& guid,
+                  HWND window,
+                  Options const& options,
+                  Stats& stats,
+                  float level)
+      : guid(&guid)
+      , window(window)
+      , options(&options)
+      , stats(&stats)
+      , level(std::bit_cast<LONG>(level))
+  {
+  }
+
+  EndpointHandler(EndpointHandler&&) = delete;
+
+  ULONG STDMETHODCALLTYPE AddRef() override
+  {
+    PRECONDITION(refCount != std::numeric_limits<ULONG>::max());
+    return InterlockedIncrement(&refCount);
+  }
+
+  ULONG STDMETHODCALLTYPE Release() override
+  {
+    PRECONDITION(refCount > 0);
+    auto result = InterlockedDecrement(&refCount);
+    if (result == 0) {
+      delete this;
+    }
+    return result;
+  }
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid,
+                                           void** ppvObject) override
+  {
+    if (ppvObject == nullptr) {
+      return E_POINTER;
+    }
+
+    if (__uuidof(IUnknown) != riid
+        || __uuidof(IAudioEndpointVolumeCallback) != riid)
+    {
+      *ppvObject = nullptr;
+      return E_NOINTERFACE;
+    }
+
+    AddRef();
+    *ppvObject = this;
+    return S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE
+  OnNotify(PAUDIO_VOLUME_NOTIFICATION_DATA data) override
+  {
+    auto arrivedAt = performanceCounter();
+    if (data == nullptr) {
+      return E_POINTER;
+    }
+
+    (void)InterlockedIncrement(&stats->notifications);
+    stats->capture(EventType::Notify,
+                   data->guidEventContext == *guid ? EventFlag::Own : 0,
+                   key,
+                   data->fMasterVolume,
+                   currentLevel());
+
+    TraceLoggingWrite(
+        traceProvider,
+        "Notify",
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+        TraceLoggingPointer(this, "Handler"),
+        TraceLoggingGuid(data->guidEventContext, "EventContext"),
+        TraceLoggingBool(data->guidEventContext == *guid, "Own"),
+        TraceLoggingFloat32(data->fMasterVolume, "MasterVolume"),
+        TraceLoggingBool(data->bMuted, "Muted"),
+        TraceLoggingUInt32(data->nChannels, "Channels"));
+    (void)InterlockedExchange(&observed,
+                              std::bit_cast<LONG>(data->fMasterVolume));
+    (void)InterlockedIncrement(&deliveries);
+    if (data->guidEventContext == *guid) {
+      return S_OK;
+    }
+
+    auto limit = currentLevel();
+    auto offending = options->channels
+        ? OffendingChannels(
+              std::span(data->afChannelVolumes, data->nChannels), limit)
+        : ULONG64 {};
+    if (offending != 0) {
+      (void)InterlockedOr64(&channels, static_cast<LONG64>(offending));
+    }
+
+    if (data->fMasterVolume <= limit && offending == 0) {
+      (void)InterlockedIncrement(&stats->suppressedCalls);
+      return S_OK;
+    }
+
+    if (data->guidEventContext != GUID {}) {
+      attributeRaise();
+    }
+
+    if (options->direct) {
+      return enforceDirectly(arrivedAt);
+    }
+
+    if (InterlockedExchange(&pending, TRUE) != FALSE) {
+      (void)InterlockedIncrement(&stats->coalescedNotifications);
+      return S_OK;
+    }
+
+    notifiedAt = arrivedAt;
+    AddRef();
+    (void)InterlockedIncrement(&stats->postedChanges);
+    if (PostMessageW(window,
+                     UserMessage::ChangeAudio,
+                     0,
+                     reinterpret_cast<LPARAM>(this))
+        == 0)
+    {
+      auto error = GetLastError();
+      (void)InterlockedDecrement(&stats->postedChanges);
+      (void)InterlockedExchange(&pending, FALSE);
+      Release();
+      return __HRESULT_FROM_WIN32(error);
+    }
+
+    return S_OK;
+  }
+
+  LONG64 acknowledge()
+  {
+    auto result = notifiedAt;
+    (void)InterlockedExchange(&pending, FALSE);
+    return result;
+  }
+
+  void configure(float value)
+  {
+    (void)InterlockedExchange(&level, std::bit_cast<LONG>(value));
+  }
+
+  float observedLevel()
+  {
+    return std::bit_cast<float>(ReadNoFence(&observed));
+  }
+
+  LONG delivered() { return ReadNoFence(&deliveries); }
+
+  void observe(float value)
+  {
+    (void)InterlockedExchange(&observed, std::bit_cast<LONG>(value));
+  }
+
+  void identify(ULONG value) { key = value; }
+
+  ULONG endpoint() const { return key; }
+
+  // A slot without raises since the last call is handed back.
+  template<typename F>
+  void takeRaises(F&& visit)
+  {
+    for (auto& slot : raiseSlots) {
+      auto processId = ReadNoFence(&slot.processId);
+      if (processId == 0) {
+        continue;
+      }
+
+      if (auto raises = InterlockedExchange(&slot.raises, 0); raises != 0) {
+        visit(static_cast<DWORD>(processId), raises);
+      } else {
+        (void)InterlockedCompareExchange(&slot.processId, 0, processId);
+      }
+    }
+
+    if (auto raises = InterlockedExchange(&unattributedRaises, 0); raises != 0)
+    {
+      visit(DWORD {}, raises);
+    }
+  }
+
+  void track(ActiveSessions const* active)
+  {
+    (void)InterlockedExchangePointer(&sessions,
+                                     const_cast<ActiveSessions*>(active));
+    quiesce();
+  }
+
+  ULONG64 takeChannels()
+  {
+    return static_cast<ULONG64>(InterlockedExchange64(&channels, 0));
+  }
+
+  void publish(IAudioEndpointVolume* volume)
+  {
+    (void)InterlockedExchangePointer(&target, volume);
+    if (volume != nullptr) {
+      return;
+    }
+
+    quiesce();
+  }
+};
+
+class NotificationClient : public IMMNotificationClient
+{
+  ULONG refCount {};
+  HWND window {};
+  Options const* options {};
+  Stats* stats {};
+
+  virtual ~NotificationClient() {}
+
+  HRESULT postDeviceId(UINT message, WPARAM wParam, LPCWSTR deviceId)
+  {
+    try {
+      auto id = std::unique_ptr<std::wstring>();
+      if (deviceId != nullptr) {
+        id = std::make_unique<std::wstring>(deviceId);
+      }
+      if (PostMessageW(
+              window, message, wParam, reinterpret_cast<LPARAM>(id.get()))
+          == 0)
+      {
+        auto error = GetLastError();
+        return __HRESULT_FROM_WIN32(error);
+      }
+      (void)id.release();
+    } catch (std::bad_alloc const&) {
+      return E_OUTOFMEMORY;
+    }
+
+    return S_OK;
+  }
+
+public:
+  NotificationClient(HWND window, Options const& options, Stats& stats)
+      : window(window)
+      , options(&options)
+      , stats(&stats)
+  {
+  }
+
+  NotificationClient(NotificationClient&&) = delete;
+
+  ULONG STDMETHODCALLTYPE AddRef() override
+  {
+    PRECONDITION(refCount != std::numeric_limits<ULONG>::max());
+    return InterlockedIncrement(&refCount);
+  }
+
+  ULONG STDMETHODCALLTYPE Release() override
+  {
+    PRECONDITION(refCount > 0);
+    auto result = InterlockedDecrement(&refCount);
+    if (result == 0) {
+      delete this;
+    }
+    return result;
+  }
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid,
+                                           void** ppvObject) override
+  {
+    if (ppvObject == nullptr) {
+      return E_POINTER;
+    }
+
+    if (__uuidof(IUnknown) != riid || __uuidof(IMMNotificationClient) != riid) {
+      *ppvObject = nullptr;
+      return E_NOINTERFACE;
+    }
+
+    AddRef();
+    *ppvObject = this;
+    return S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE OnDefaultDeviceChanged(EDataFlow flow,
+                                                   ERole role,
+                                                   LPCWSTR deviceId) override
+  {
+    TraceLoggingWrite(traceProvider,
+                      "DefaultDeviceChanged",
+                      TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+                      TraceLoggingInt32(flow, "Flow"),
+                      TraceLoggingInt32(role, "Role"),
+                      TraceLoggingWideString(deviceId, "DeviceId"));
+    stats->capture(EventType::DefaultChanged,
+                   static_cast<USHORT>(MAKEWORD(flow, role)),
+                   deviceId != nullptr ? EndpointKey(deviceId) : 0,
+                   0.0f,
+                   0.0f);
+    if (options->allEndpoints || !IsEnforcedFlow(*options, flow)
+        || role != eConsole)
+    {
+      return S_OK;
+    }
+
+    return postDeviceId(UserMessage::GetDefaultEndpoint, flow, deviceId);
+  }
+
+  HRESULT STDMETHODCALLTYPE OnDeviceStateChanged(LPCWSTR deviceId,
+                                                 DWORD) override
+  {
+    return postDeviceId(UserMessage::EndpointChanged, 0, deviceId);
+  }
+
+  HRESULT STDMETHODCALLTYPE OnDeviceAdded(LPCWSTR deviceId) override
+  {
+    return postDeviceId(UserMessage::EndpointChanged, 0, deviceId);
+  }
+
+  HRESULT STDMETHODCALLTYPE OnDeviceRemoved(LPCWSTR deviceId) override
+  {
+    return postDeviceId(UserMessage::EndpointChanged, 0, deviceId);
+  }
+
+  HRESULT STDMETHODCALLTYPE OnPropertyValueChanged(  //
+      LPCWSTR,
+      const PROPERTYKEY) override
+  {
+    return S_OK;
+  }
+};
+
+class SessionNotification : public IAudioSessionNotification
+{
+  ULONG refCount {};
+  HWND window {};
+
+  virtual ~SessionNotification() {}
+
+public:
+  explicit SessionNotification(HWND window)
+      : window(window)
+  {
+  }
+
+  SessionNotification(SessionNotification&&) = delete;
+
+  ULONG STDMETHODCALLTYPE AddRef() override
+  {
+    PRECONDITION(refCount != std::numeric_limits<ULONG>::max());
+    return InterlockedIncrement(&refCount);
+  }
+
+  ULONG STDMETHODCALLTYPE Release() override
+  {
+    PRECONDITION(refCount > 0);
+    auto result = InterlockedDecrement(&refCount);
+    if (result == 0) {
+      delete this;
+    }
+    return result;
+  }
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid,
+                                           void** ppvObject) override
+  {
+    if (ppvObject == nullptr) {
+      return E_POINTER;
+    }
+
+    if (__uuidof(IUnknown) != riid
+        && __uuidof(IAudioSessionNotification) != riid)
+    {
+      *ppvObject = nullptr;
+      return E_NOINTERFACE;
+    }
+
+    AddRef();
+    *ppvObject = this;
+    return S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE
+  OnSessionCreated(IAudioSessionControl* session) override
+  {
+    if (session == nullptr) {
+      return E_POINTER;
+    }
+
+    AddRef();
+    session->AddRef();
+    if (PostMessageW(window,
+                     UserMessage::SessionCreated,
+                     reinterpret_cast<WPARAM>(this),
+                     reinterpret_cast<LPARAM>(session))
+        == 0)
+    {
+      auto error = GetLastError();
+      session->Release();
+      Release();
+      return __HRESULT_FROM_WIN32(error);
+    }
+
+    return S_OK;
+  }
+};
+
+class SessionHandler : public IAudioSessionEvents
+{
+  ULONG refCount {};
+  LONG pending {};
+  GUID* guid {};
+  HWND window {};
+
+  virtual ~SessionHandler() {}
+
+  HRESULT post()
+  {
+    if (InterlockedExchange(&pending, TRUE) != FALSE) {
+      return S_OK;
+    }
+
+    AddRef();
+    if (PostMessageW(window,
+                     UserMessage::ChangeSession,
+                     0,
+                     reinterpret_cast<LPARAM>(this))
+        == 0)
+    {
+      auto error = GetLastError();
+      (void)InterlockedExchange(&pending, FALSE);
+      Release();
+      return __HRESULT_FROM_WIN32(error);
+    }
+
+    return S_OK;
+  }
+
+public:
+  SessionHandler(GUID& guid, HWND window)
+      : guid(&guid)
+      , window(window)
+  {
+  }
+
+  SessionHandler(SessionHandler&&) = delete;
+
+  ULONG STDMETHODCALLTYPE AddRef() override
+  {
+    PRECONDITION(refCount != std::numeric_limits<ULONG>::max());
+    return InterlockedIncrement(&refCount);
+  }
+
+  ULONG STDMETHODCALLTYPE Release() override
+  {
+    PRECONDITION(refCount > 0);
+    auto result = InterlockedDecrement(&refCount);
+    if (result == 0) {
+      delete this;
+    }
+    return result;
+  }
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid,
+                                           void** ppvObject) override
+  {
+    if (ppvObject == nullptr) {
+      return E_POINTER;
+    }
+
+    if (__uuidof(IUnknown) != riid && __uuidof(IAudioSessionEvents) != riid)
+    {
+      *ppvObject = nullptr;
+      return E_NOINTERFACE;
+    }
+
+    AddRef();
+    *ppvObject = this;
+    return S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE OnDisplayNameChanged(LPCWSTR, LPCGUID) override
+  {
+    return S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE OnIconPathChanged(LPCWSTR, LPCGUID) override
+  {
+    return S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE OnSimpleVolumeChanged(float,
+                                                  BOOL muted,
+                                                  LPCGUID context) override
+  {
+    if (muted != FALSE || (context != nullptr && *context == *guid)) {
+      return S_OK;
+    }
+
+    return post();
+  }
+
+  HRESULT STDMETHODCALLTYPE OnChannelVolumeChanged(DWORD,
+                                                   float[],
+                                                   DWORD,
+                                                   LPCGUID) override
+  {
+    return S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE OnGroupingParamChanged(LPCGUID, LPCGUID) override
+  {
+    return S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE OnStateChanged(AudioSessionState state) override
+  {
+    if (state != AudioSessionStateExpired) {
+      return S_OK;
+    }
+
+    return post();
+  }
+
+  HRESULT STDMETHODCALLTYPE
+  OnSessionDisconnected(AudioSessionDisconnectReason) override
+  {
+    return post();
+  }
+
+  void acknowledge() { (void)InterlockedExchange(&pending, FALSE); }
+};
+
+class SessionSubscription
+{
+  ComPtr<IAudioSessionControl2> _control;
+  ComPtr<ISimpleAudioVolume> _volume;
+  ComPtr<SessionHandler> _handler;
+  DWORD _processId {};
+  std::wstring _instance;
+
+public:
+  SessionSubscription(ComPtr<IAudioSessionControl2> control,
+                      DWORD processId,
+                      std::wstring_view instance,
+                      GUID& guid,
+                      HWND window)
+      : _control(std::move(control))
+      , _processId(processId)
+      , _instance(instance)
+  {
+    throwIfCOM(_control->QueryInterface(__uuidof(ISimpleAudioVolume),
+                                        std::out_ptr(_volume)));
+    _handler = makeComObject<SessionHandler>(guid, window);
+    throwIfCOM(_control->RegisterAudioSessionNotification(_handler.get()));
+  }
+
+  SessionSubscription(SessionSubscription&&) = delete;
+
+  ~SessionSubscription()
+  {
+    if (FAILED(_control->UnregisterAudioSessionNotification(_handler.get()))) {
+      outputStacktrace();
+      OutputDebugStringW(L"UnregisterAudioSessionNotification failed\n");
+    }
+  }
+
+  DWORD processId() const { return _processId; }
+
+  std::wstring_view instance() const { return _instance; }
+
+  SessionHandler* handler() const { return _handler.get(); }
+
+  Result<bool> expired() const
+  {
+    auto state = AudioSessionState {};
+    PROPAGATE(checkCOM(_control->GetState(&state)));
+    return state == AudioSessionStateExpired;
+  }
+
+  Result<> limit(float level, GUID const* context)
+  {
+    if (level == 0.0f) {
+      return checkCOM(_volume->SetMute(TRUE, context));
+    }
+
+    auto current = float {};
+    PROPAGATE(checkCOM(_volume->GetMasterVolume(&current)));
+    if (current <= level) {
+      return {};
+    }
+    return checkCOM(_volume->SetMasterVolume(level, context));
+  }
+};
+
+class TopologyHandler : public IControlChangeNotify
+{
+  ULONG refCount {};
+  LONG pending {};
+  GUID* guid {};
+  HWND window {};
+
+  virtual ~TopologyHandler() {}
+
+public:
+  TopologyHandler(GUID& guid, HWND window)
+      : guid(&guid)
+      , window(window)
+  {
+  }
+
+  TopologyHandler(TopologyHandler&&) = delete;
+
+  ULONG STDMETHODCALLTYPE AddRef() override
+  {
+    PRECONDITION(refCount != std::numeric_limits<ULONG>::max());
+    return InterlockedIncrement(&refCount);
+  }
+
+  ULONG STDMETHODCALLTYPE Release() override
+  {
+    PRECONDITION(refCount > 0);
+    auto result = InterlockedDecrement(&refCount);
+    if (result == 0) {
+      delete this;
+    }
+    return result;
+  }
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid,
+                                           void** ppvObject) override
+  {
+    if (ppvObject == nullptr) {
+      return E_POINTER;
+    }
+
+    if (__uuidof(IUnknown) != riid && __uuidof(IControlChangeNotify) != riid)
+    {
+      *ppvObject = nullptr;
+      return E_NOINTERFACE;
+    }
+
+    AddRef();
+    *ppvObject = this;
+    return S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE OnNotify(DWORD, LPCGUID context) override
+  {
+    if (context != nullptr && *context == *guid) {
+      return S_OK;
+    }
+
+    if (InterlockedExchange(&pending, TRUE) != FALSE) {
+      return S_OK;
+    }
+
+    AddRef();
+    if (PostMessageW(window,
+                     UserMessage::HardwareMuteChanged,
+                     0,
+                     reinterpret_cast<LPARAM>(this))
+        == 0)
+    {
+      auto error = GetLastError();
+      (void)InterlockedExchange(&pending, FALSE);
+      Release();
+      return __HRESULT_FROM_WIN32(error);
+    }
+
+    return S_OK;
+  }
+
+  void acknowledge() { (void)InterlockedExchange(&pending, FALSE); }
+};
+
+constexpr auto maxTopologyParts = std::size_t {64};
+
+class HardwareMute
+{
+  ComPtr<IPart> _part;
+  ComPtr<IAudioMute> _mute;
+  ComPtr<TopologyHandler> _handler;
+
+public:
+  HardwareMute(IMMDevice* device, GUID& guid, HWND window)
+      : _handler(makeComObject<TopologyHandler>(guid, window))
+  {
+    auto endpoint = ComPtr<IMMEndpoint>();
+    auto flow = EDataFlow {};
+    auto topology = ComPtr<IDeviceTopology>();
+    auto connector = ComPtr<IConnector>();
+    auto connected = ComPtr<IConnector>();
+    auto part = ComPtr<IPart>();
+    if (FAILED(device->QueryInterface(__uuidof(IMMEndpoint),
+                                      std::out_ptr(endpoint)))
+        || FAILED(endpoint->GetDataFlow(&flow))
+        || FAILED(device->Activate(__uuidof(IDeviceTopology),
+                                   CLSCTX_INPROC_SERVER,
+                                   nullptr,
+                                   std::out_ptr(topology)))
+        || FAILED(topology->GetConnector(0, std::out_ptr(connector)))
+        || FAILED(connector->GetConnectedTo(std::out_ptr(connected)))
+        || FAILED(connected->QueryInterface(__uuidof(IPart),
+                                            std::out_ptr(part))))
+    {
+      return;
+    }
+
+    auto parts = std::vector<ComPtr<IPart>> {};
+    parts.push_back(std::move(part));
+    for (auto i = std::size_t {}; i != parts.size() && i != maxTopologyParts;
+         ++i)
+    {
+      auto* current = parts[i].get();
+      auto mute = ComPtr<IAudioMute>();
+      if (SUCCEEDED(current->Activate(CLSCTX_INPROC_SERVER,
+                                      __uuidof(IAudioMute),
+                                      std::out_ptr(mute)))
+          && SUCCEEDED(current->RegisterControlChangeCallback(
+              __uuidof(IAudioMute), _handler.get())))
+      {
+        _part = std::move(parts[i]);
+        _mute = std::move(mute);
+        return;
+      }
+
+      auto next = ComPtr<IPartsList>();
+      auto count = UINT {};
+      if (FAILED(flow == eRender
+                     ? current->EnumPartsIncoming(std::out_ptr(next))
+                     : current->EnumPartsOutgoing(std::out_ptr(next)))
+          || FAILED(next->GetCount(&count)))
+      {
+        continue;
+      }
+
+      for (auto j = UINT {}; j != count; ++j) {
+        auto nextPart = ComPtr<IPart>();
+        if (SUCCEEDED(next->GetPart(j, std::out_ptr(nextPart)))) {
+          parts.push_back(std::move(nextPart));
+        }
+      }
+    }
+  }
+
+  HardwareMute(HardwareMute&&) = delete;
+
+  ~HardwareMute()
+  {
+    if (_part != nullptr
+        && FAILED(_part->UnregisterControlChangeCallback(_handler.get())))
+    {
+      outputStacktrace();
+      OutputDebugStringW(L"UnregisterControlChangeCallback failed\n");
+    }
+  }
+
+  bool engaged() const { return _mute != nullptr; }
+
+  TopologyHandler* handler() const { return _handler.get(); }
+
+  HRESULT mute(GUID const* context) const
+  {
+    auto muted = BOOL {};
+    if (auto result = _mute->GetMute(&muted);
+        FAILED(result) || muted != FALSE)
+    {
+      return result;
+    }
+
+    return _mute->SetMute(TRUE, context);
+  }
+};
+
+class EndpointSubscription
+{
+  ComPtr<IMMDevice> _device;
+  ComPtr<IAudioEndpointVolume> _volume;
+  ComPtr<EndpointHandler> _handler;
+  ComPtr<IAudioSessionManager2> _sessionManager;
+  ComPtr<SessionNotification> _sessionNotification;
+  ComPtr<IAudioSessionManager2> _activityManager;
+  ComPtr<SessionNotification> _activityNotification;
+  std::unique_ptr<ActiveSessions> _activeSessions;
+  std::optional<HardwareMute> _hardwareMute;
+  std::uint64_t _lastUsed {};
+  Policy _policy {};
+  LONG _polledDeliveries {};
+  LONG _confirmedChanges {};
+  bool _polled {true};
+  bool _missedNotification {};
+
+public:
+  EndpointSubscription(ComPtr<IMMDevice> device,
+                       GUID& guid,
+                       HWND window,
+                       Options const& options,
+                       Stats& stats,
+                       Policy policy)
+      : _device(std::move(device))
+      , _handler(makeComObject<EndpointHandler>(
+            guid, window, options, stats, policy.level))
+      , _policy(policy)
+  {
+    if (policy.ignore) {
+      return;
+    }
+
+    if (options.sessions) {
+      throwIfCOM(_device->Activate(  //
+          __uuidof(IAudioSessionManager2),
+          CLSCTX_INPROC_SERVER,
+          nullptr,
+          std::out_ptr(_sessionManager)));
+      _sessionNotification = makeComObject<SessionNotification>(window);
+      throwIfCOM(_sessionManager->RegisterSessionNotification(
+          _sessionNotification.get()));
+      return;
+    }
+
+    if (options.topology && policy.level == 0.0f) {
+      _hardwareMute.emplace(_device.get(), guid, window);
+      if (_hardwareMute->engaged()) {
+        return;
+      }
+      _hardwareMute.reset();
+    }
+
+    throwIfCOM(_device->Activate(  //
+        __uuidof(IAudioEndpointVolume),
+        CLSCTX_INPROC_SERVER,
+        nullptr,
+        std::out_ptr(_volume)));
+    throwIfCOM(_volume->RegisterControlChangeNotify(_handler.get()));
+  }
+
+  EndpointSubscription(EndpointSubscription&&) = delete;
+
+  ~EndpointSubscription()
+  {
+    _handler->track(nullptr);
+    _handler->publish(nullptr);
+    if (_activityManager != nullptr
+        && FAILED(_activityManager->UnregisterSessionNotification(
+            _activityNotification.get())))
+    {
+      outputStacktrace();
+      OutputDebugStringW(L"UnregisterSessionNotification failed\n");
+    }
+    if (_sessionManager != nullptr
+        && FAILED(_sessionManager->UnregisterSessionNotification(
+            _sessionNotification.get())))
+    {
+      outputStacktrace();
+      OutputDebugStringW(L"UnregisterSessionNotification failed\n");
+    }
+    if (_volume != nullptr
+        && FAILED(_volume->UnregisterControlChangeNotify(_handler.get())))
+    {
+      outputStacktrace();
+      OutputDebugStringW(L"UnregisterControlChangeNotify failed\n");
+    }
+  }
+
+  IAudioEndpointVolume* volume() const { return _volume.get(); }
+
+  IAudioSessionManager2* sessionManager() const
+  {
+    return _sessionManager.get();
+  }
+
+  EndpointHandler* handler() const { return _handler.get(); }
+
+  SessionNotification* sessionNotification() const
+  {
+    return _sessionNotification.get();
+  }
+
+  HardwareMute const* hardwareMute() const
+  {
+    return _hardwareMute ? &*_hardwareMute : nullptr;
+  }
+
+  SessionNotification* activityNotification() const
+  {
+    return _activityNotification.get();
+  }
+
+  Result<> trackSessions(HWND window)
+  {
+    if (_volume == nullptr) {
+      return {};
+    }
+
+    if (_activityManager == nullptr) {
+      PROPAGATE(checkCOM(_device->Activate(  //
+          __uuidof(IAudioSessionManager2),
+          CLSCTX_INPROC_SERVER,
+          nullptr,
+          std::out_ptr(_activityManager))));
+      _activityNotification = makeComObject<SessionNotification>(window);
+      if (auto result = checkCOM(_activityManager->RegisterSessionNotification(
+              _activityNotification.get()));
+          !result)
+      {
+        _activityManager.reset();
+        _activityNotification.reset();
+        return result;
+      }
+    }
+
+    auto enumerator = ComPtr<IAudioSessionEnumerator>();
+    PROPAGATE(checkCOM(
+        _activityManager->GetSessionEnumerator(std::out_ptr(enumerator))));
+
+    auto count = 0;
+    PROPAGATE(checkCOM(enumerator->GetCount(&count)));
+    auto active = std::make_unique<ActiveSessions>();
+    for (auto i = 0; i != count; ++i) {
+      auto session = ComPtr<IAudioSessionControl>();
+      PROPAGATE(checkCOM(enumerator->GetSession(i, std::out_ptr(session))));
+
+      auto control = ComPtr<IAudioSessionControl2>();
+      PROPAGATE(checkCOM(session->QueryInterface(
+          __uuidof(IAudioSessionControl2), std::out_ptr(control))));
+
+      auto state = AudioSessionState {};
+      PROPAGATE(checkCOM(control->GetState(&state)));
+      auto processId = DWORD {};
+      if (state != AudioSessionStateExpired
+          && control->GetProcessId(&processId) == S_OK)
+      {
+        active->emplace_back(processId, std::move(control));
+      }
+    }
+
+    _handler->track(active.get());
+    _activeSessions = std::move(active);
+    return {};
+  }
+
+  std::uint64_t lastUsed() const { return _lastUsed; }
+
+  Policy policy() const { return _policy; }
+
+  bool polled() const { return _polled; }
+
+  bool missedNotification() const { return _missedNotification; }
+
+  void stopPolling() { _polled = false; }
+
+  void missNotification() { _missedNotification = true; }
+
+  LONG confirmedChanges() const { return _confirmedChanges; }
+
+  // Notifications since the last poll whose last reported volume matches the
+  // polled one count towards trusting the endpoint's notifications.
+  void poll(float current, LONG deliveries, float observed)
+  {
+    if (deliveries != _polledDeliveries && current == observed) {
+      ++_confirmedChanges;
+    }
+    _polledDeliveries = deliveries;
+  }
+
+  void configure(Policy policy)
+  {
+    _policy = policy;
+    _handler->configure(policy.level);
+  }
+
+  void enforce(bool enabled)
+  {
+    _handler->publish(enabled ? _volume.get() : nullptr);
+  }
+
+  void use(std::uint64_t counter) { _lastUsed = counter; }
+};
+
+constexpr auto endpointCacheSize = std::size_t {8};
+constexpr auto policyReloadMilliseconds = UINT {100};
+constexpr auto reliableNotifications = LONG {3};
+constexpr auto minRetryMilliseconds = UINT {100};
+constexpr auto maxRetryMilliseconds = UINT {10'000};
+
+struct QueuedCommand
+{
+  SLIST_ENTRY entry;
+  RemoteCommand command;
+};
+
+class CommandQueue
+{
+  SLIST_HEADER _head;
+  HWND _window {};
+
+public:
+  CommandQueue() { InitializeSListHead(&_head); }
+
+  CommandQueue(CommandQueue&&) = delete;
+
+  ~CommandQueue()
+  {
+    drain([](RemoteCommand) {});
+  }
+
+  void attach(HWND window)
+  {
+    WritePointerRelease(reinterpret_cast<PVOID*>(&_window), window);
+    if (QueryDepthSList(&_head) != 0) {
+      (void)PostMessageW(window, UserMessage::DrainCommands, 0, 0);
+    }
+  }
+
+  void push(RemoteCommand command)
+  {
+    auto* queued = new QueuedCommand {.command = command};
+    if (InterlockedPushEntrySList(&_head, &queued->entry) != nullptr) {
+      return;
+    }
+
+    auto* window = static_cast<HWND>(
+        ReadPointerAcquire(reinterpret_cast<PVOID*>(&_window)));
+    if (window != nullptr) {
+      (void)PostMessageW(window, UserMessage::DrainCommands, 0, 0);
+    }
+  }
+
+  void drain(auto&& handle)
+  {
+    auto* reversed = InterlockedFlushSList(&_head);
+    auto* entry = static_cast<PSLIST_ENTRY>(nullptr);
+    while (reversed != nullptr) {
+      auto* next = reversed->Next;
+      reversed->Next = entry;
+      entry = reversed;
+      reversed = next;
+    }
+
+    while (entry != nullptr) {
+      auto queued = std::unique_ptr<QueuedCommand>(
+          CONTAINING_RECORD(entry, QueuedCommand, entry));
+      entry = entry->Next;
+      handle(queued->command);
+    }
+  }
+};
+
+struct State
+{
+  HINSTANCE hInstance {};
+  GUID* guid {};
+  IMMDeviceEnumerator* deviceEnumerator {};
+  std::map<std::wstring, EndpointSubscription, std::less<>> endpoints {};
+  std::array<EndpointSubscription*, 2> defaultEndpoints {};
+  std::uint64_t endpointUses {};
+  std::array<std::unique_ptr<std::wstring>, 2> pendingDefaults {};
+  std::multimap<EndpointSubscription const*, SessionSubscription> sessions {};
+  HANDLE pollTimer {};
+  bool pollArmed {};
+  bool paused {};
+  bool inBackground {};
+  bool dumped {};
+  bool attributing {};
+  UINT retryMilliseconds {};
+  CommandQueue* commands {};
+  Options options {};
+  PolicyTable policies {};
+  Stats& stats;
+};
+
+LONG64 toMicroseconds(FILETIME time)
+{
+  return static_cast<LONG64>(
+      ULARGE_INTEGER {.LowPart = time.dwLowDateTime,
+                      .HighPart = time.dwHighDateTime}
+          .QuadPart
+      / 10);
+}
+
+void RecordFirstMute(Stats& stats)
+{
+  if (stats.firstMuteMicroseconds != 0) {
+    return;
+  }
+
+  auto creation = FILETIME {};
+  auto exit = FILETIME {};
+  auto kernel = FILETIME {};
+  auto user = FILETIME {};
+  if (GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)
+      == 0)
+  {
+    return;
+  }
+
+  auto now = FILETIME {};
+  GetSystemTimePreciseAsFileTime(&now);
+  WriteNoFence64(
+      &stats.firstMuteMicroseconds,
+      std::max(toMicroseconds(now) - toMicroseconds(creation), LONG64 {1}));
+
+  auto path = std::array<wchar_t, MAX_PATH> {};
+  auto image = WIN32_FILE_ATTRIBUTE_DATA {};
+  if (GetModuleFileNameW(nullptr, path.data(), MAX_PATH) == 0
+      || GetFileAttributesExW(path.data(), GetFileExInfoStandard, &image) == 0)
+  {
+    image = {};
+  }
+
+  auto memory = QueryMemoryUsage().value_or(MemoryUsage {});
+  TraceLoggingWrite(
+      traceProvider,
+      "FirstMute",
+      TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+      TraceLoggingInt64(stats.firstMuteMicroseconds, "SinceProcessStartUs"),
+      TraceLoggingUInt32(image.nFileSizeLow, "ImageBytes"),
+      TraceLoggingUInt64(memory.privateBytes, "PrivateBytes"),
+      TraceLoggingUInt64(memory.workingSet, "WorkingSet"),
+      TraceLoggingBool(leanBuild, "Lean"));
+}
+
+Result<> ChangeAudio(State& state, EndpointSubscription const& endpoint)
+{
+  if (auto* hardwareMute = endpoint.hardwareMute(); hardwareMute != nullptr) {
+    auto result = hardwareMute->mute(state.guid);
+    state.stats.capture(EventType::Enforce,
+                        EventFlag::Hardware,
+                        endpoint.handler()->endpoint(),
+                        0.0f,
+                        0.0f);
+    TraceLoggingWrite(traceProvider,
+                      "HardwareMute",
+                      TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                      TraceLoggingPointer(hardwareMute, "Endpoint"),
+                      TraceLoggingHResult(result, "Result"));
+    PROPAGATE(checkCOM(result));
+    RecordFirstMute(state.stats);
+    return {};
+  }
+
+  auto* endpointVolume = endpoint.volume();
+  if (endpointVolume == nullptr) {
+    return {};
+  }
+
+  auto level = endpoint.policy().level;
+  auto* handler = endpoint.handler();
+  auto current = handler->observedLevel();
+  if (current == std::numeric_limits<float>::infinity() && level > 0.0f) {
+    PROPAGATE(checkCOM(endpointVolume->GetMasterVolumeLevelScalar(&current)));
+  }
+
+  auto channels = handler->takeChannels();
+  if (current <= level && channels == 0) {
+    (void)InterlockedIncrement(&state.stats.suppressedCalls);
+    RecordFirstMute(state.stats);
+    return {};
+  }
+
+  auto result = EnforceLevel(
+      endpointVolume, current > level, channels, level, state.guid);
+  (void)InterlockedIncrement(&state.stats.enforcementCalls);
+  state.stats.capture(
+      EventType::Enforce, 0, handler->endpoint(), current, level);
+  TraceLoggingWrite(traceProvider,
+                    "ChangeAudio",
+                    TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                    TraceLoggingPointer(endpointVolume, "Endpoint"),
+                    TraceLoggingBool(false, "Direct"),
+                    TraceLoggingFloat32(level, "Level"),
+                    TraceLoggingHexUInt64(channels, "Channels"),
+                    TraceLoggingHResult(result, "Result"));
+  PROPAGATE(checkCOM(result));
+  RecordFirstMute(state.stats);
+  return {};
+}
+
+// The endpoint is on its way out and takes the session with it.
+Result<> IgnoreInvalidatedDevice(Result<> result)
+{
+  if (!result && result.error() == AUDCLNT_E_DEVICE_INVALIDATED) {
+    return {};
+  }
+
+  return result;
+}
+
+Result<> AddSession(State& state,
+                    HWND hwnd,
+                    EndpointSubscription const& endpoint,
+                    IAudioSessionControl* session)
+{
+  auto control = ComPtr<IAudioSessionControl2>();
+  PROPAGATE(checkCOM(session->QueryInterface(__uuidof(IAudioSessionControl2),
+                                             std::out_ptr(control))));
+
+  auto processId = DWORD {};
+  if (auto result = control->GetProcessId(&processId);
+      result != AUDCLNT_S_NO_SINGLE_PROCESS)
+  {
+    PROPAGATE(checkCOM(result));
+  }
+
+  auto instance = CoTaskMemPtr<wchar_t>();
+  PROPAGATE(checkCOM(
+      control->GetSessionInstanceIdentifier(std::out_ptr(instance))));
+
+  auto sameInstance = [&](auto const& entry)
+  { return entry.second.instance() == instance.get(); };
+  auto [first, last] = state.sessions.equal_range(&endpoint);
+  if (std::ranges::any_of(first, last, sameInstance)) {
+    return {};
+  }
+
+  auto it = decltype(state.sessions)::iterator();
+  try {
+    it = state.sessions.emplace(
+        std::piecewise_construct,
+        std::forward_as_tuple(&endpoint),
+        std::forward_as_tuple(
+            std::move(control), processId, instance.get(), *state.guid, hwnd));
+  } catch (com_error const& error) {
+    return std::unexpected(static_cast<HRESULT>(error.code()));
+  }
+
+  if (auto result = it->second.limit(endpoint.policy().level, state.guid);
+      !result)
+  {
+    (void)state.sessions.erase(it);
+    return IgnoreInvalidatedDevice(result);
+  }
+
+  RecordFirstMute(state.stats);
+  return {};
+}
+
+Result<> EnumerateSessions(State& state,
+                           HWND hwnd,
+                           EndpointSubscription const& endpoint)
+{
+  auto* sessionManager = endpoint.sessionManager();
+  if (sessionManager == nullptr) {
+    return {};
+  }
+
+  auto enumerator = ComPtr<IAudioSessionEnumerator>();
+  PROPAGATE(checkCOM(
+      sessionManager->GetSessionEnumerator(std::out_ptr(enumerator))));
+
+  auto count = 0;
+  PROPAGATE(checkCOM(enumerator->GetCount(&count)));
+  for (auto i = 0; i != count; ++i) {
+    auto session = ComPtr<IAudioSessionControl>();
+    PROPAGATE(checkCOM(enumerator->GetSession(i, std::out_ptr(session))));
+    PROPAGATE(AddSession(state, hwnd, endpoint, session.get()));
+  }
+
+  return {};
+}
+
+Result<> ChangeSession(State& state, SessionHandler* handler)
+{
+  auto byHandler = [&](auto const& entry)
+  { return entry.second.handler() == handler; };
+  auto it = std::ranges::find_if(state.sessions, byHandler);
+  if (it == state.sessions.end()) {
+    return {};
+  }
+
+  auto expired = it->second.expired();
+  if (expired.value_or(true)) {
+    (void)state.sessions.erase(it);
+    return IgnoreInvalidatedDevice(expired.transform([](bool) {}));
+  }
+
+  if (auto result = it->second.limit(it->first->policy().level, state.guid);
+      !result)
+  {
+    (void)state.sessions.erase(it);
+    return IgnoreInvalidatedDevice(result);
+  }
+
+  return {};
+}
+
+bool IsDefaultEndpoint(State const& state, EndpointSubscription const& endpoint)
+{
+  return std::ranges::find(state.defaultEndpoints, &endpoint)
+      != state.defaultEndpoints.end();
+}
+
+bool IsPendingDefault(State const& state, std::wstring_view id)
+{
+  return std::ranges::any_of(state.pendingDefaults,
+                             [&](auto const& pendingDefault)
+                             {
+                               return pendingDefault != nullptr
+                                   && *pendingDefault == id;
+                             });
+}
+
+using EndpointIterator = decltype(State::endpoints)::iterator;
+
+void RemoveEndpoint(State& state, EndpointIterator it)
+{
+  for (auto*& defaultEndpoint : state.defaultEndpoints) {
+    if (defaultEndpoint == &it->second) {
+      defaultEndpoint = nullptr;
+    }
+  }
+
+  (void)state.sessions.erase(&it->second);
+  (void)state.endpoints.erase(it);
+}
+
+void RemoveEndpoint(State& state, std::wstring_view id)
+{
+  if (auto it = state.endpoints.find(id); it != state.endpoints.end()) {
+    RemoveEndpoint(state, it);
+  }
+}
+
+void EvictEndpoint(State& state)
+{
+  if (state.endpoints.size() < endpointCacheSize) {
+    return;
+  }
+
+  auto lastUsed = [&](auto const& entry)
+  {
+    return IsDefaultEndpoint(state, entry.second)
+        ? std::numeric_limits<std::uint64_t>::max()
+        : entry.second.lastUsed();
+  };
+  RemoveEndpoint(state,
+                 std::ranges::min_element(state.endpoints, {}, lastUsed));
+}
+
+Result<> ArmPolling(State& state)
+{
+  if (state.pollTimer == nullptr || state.pollArmed) {
+    return {};
+  }
+
+  auto period = state.options.pollMilliseconds;
+  auto dueTime = LARGE_INTEGER {.QuadPart = -10'000LL * period};
+  PROPAGATE(checkWin32(SetWaitableTimerEx(state.pollTimer,
+                                          &dueTime,
+                                          static_cast<LONG>(period),
+                                          nullptr,
+                                          nullptr,
+                                          nullptr,
+                                          period)
+                       == 0));
+  state.pollArmed = true;
+  return {};
+}
+
+Result<> PollEndpoints(State& state)
+{
+  auto polling = false;
+  for (auto& [id, endpoint] : state.endpoints) {
+    auto* volume = endpoint.volume();
+    if (volume == nullptr || !endpoint.polled()
+        || !(state.options.allEndpoints || IsDefaultEndpoint(state, endpoint)))
+    {
+      continue;
+    }
+
+    auto* handler = endpoint.handler();
+    if (!endpoint.missedNotification()
+        && endpoint.confirmedChanges() >= reliableNotifications)
+    {
+      endpoint.stopPolling();
+      TraceLoggingWrite(
+          traceProvider,
+          "StopPolling",
+          TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+          TraceLoggingCountedWideString(
+              id.data(), static_cast<USHORT>(id.size()), "DeviceId"));
+      continue;
+    }
+
+    polling = true;
+    auto current = float {};
+    if (FAILED(volume->GetMasterVolumeLevelScalar(&current))) {
+      continue;
+    }
+
+    endpoint.poll(current, handler->delivered(), handler->observedLevel());
+    auto level = endpoint.policy().level;
+    if (current <= level) {
+      continue;
+    }
+
+    if (handler->observedLevel() <= level) {
+      endpoint.missNotification();
+    }
+
+    ++state.stats.pollCorrections;
+    TraceLoggingWrite(
+        traceProvider,
+        "PollCorrection",
+        TraceLoggingLevel(WINEVENT_LEVEL_WARNING),
+        TraceLoggingCountedWideString(
+            id.data(), static_cast<USHORT>(id.size()), "DeviceId"),
+        TraceLoggingFloat32(current, "MasterVolume"));
+    handler->observe(current);
+    PROPAGATE(ChangeAudio(state, endpoint));
+  }
+
+  if (!polling) {
+    PROPAGATE(checkWin32(CancelWaitableTimer(state.pollTimer) == 0));
+    state.pollArmed = false;
+  }
+
+  return {};
+}
+
+Result<EndpointSubscription*> AcquireEndpoint(State& state,
+                                              HWND hwnd,
+                                              std::wstring_view id,
+                                              ComPtr<IMMDevice> device)
+{
+  if (auto it = state.endpoints.find(id); it != state.endpoints.end()) {
+    return &it->second;
+  }
+
+  if (!state.options.allEndpoints) {
+    EvictEndpoint(state);
+  }
+
+  auto activatingAt = performanceCounter();
+  auto policy = state.policies.find(id);
+  auto it = EndpointIterator();
+  try {
+    it = state.endpoints
+             .try_emplace(std::wstring(id),
+                          std::move(device),
+                          *state.guid,
+                          hwnd,
+                          state.options,
+                          state.stats,
+                          policy)
+             .first;
+  } catch (com_error const& error) {
+    return std::unexpected(static_cast<HRESULT>(error.code()));
+  }
+
+  auto& endpoint = it->second;
+  endpoint.handler()->identify(EndpointKey(id));
+  if (endpoint.volume() != nullptr) {
+    PROPAGATE(ArmPolling(state));
+  }
+  if (state.attributing) {
+    PROPAGATE(endpoint.trackSessions(hwnd));
+  }
+  TraceLoggingWrite(
+      traceProvider,
+      "ActivateEndpoint",
+      TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+      TraceLoggingCountedWideString(
+          id.data(), static_cast<USHORT>(id.size()), "DeviceId"),
+      TraceLoggingBool(policy.ignore, "Ignored"),
+      TraceLoggingFloat32(policy.level, "Level"),
+      TraceLoggingInt64(toMicroseconds(performanceCounter() - activatingAt),
+                        "DurationUs"));
+  endpoint.enforce(state.options.allEndpoints);
+  if (state.options.allEndpoints) {
+    PROPAGATE(EnumerateSessions(state, hwnd, endpoint));
+  }
+  return &endpoint;
+}
+
+Result<EDataFlow> EndpointFlow(IMMDevice* device)
+{
+  auto endpoint = ComPtr<IMMEndpoint>();
+  PROPAGATE(checkCOM(device->QueryInterface(__uuidof(IMMEndpoint),
+                                            std::out_ptr(endpoint))));
+
+  auto flow = EDataFlow {};
+  PROPAGATE(checkCOM(endpoint->GetDataFlow(&flow)));
+  return flow;
+}
+
+Result<> SetDefaultEndpoint(State& state,
+                            HWND hwnd,
+                            EDataFlow flow,
+                            std::wstring const* id)
+{
+  auto*& defaultEndpoint = state.defaultEndpoints[flow];
+  if (defaultEndpoint != nullptr) {
+    defaultEndpoint->enforce(false);
+    defaultEndpoint = nullptr;
+  }
+
+  if (!state.options.allEndpoints) {
+    (void)std::erase_if(state.sessions,
+                        [&](auto const& entry)
+                        { return !IsDefaultEndpoint(state, *entry.first); });
+  }
+
+  auto device = ComPtr<IMMDevice>();
+  auto defaultId = CoTaskMemPtr<wchar_t>();
+  if (id == nullptr) {
+    if (auto result = state.deviceEnumerator->GetDefaultAudioEndpoint(
+            flow, eConsole, std::out_ptr(device));
+        result == E_NOTFOUND)
+    {
+      return {};
+    } else {
+      PROPAGATE(checkCOM(result));
+    }
+
+    PROPAGATE(checkCOM(device->GetId(std::out_ptr(defaultId))));
+  }
+
+  auto key = id != nullptr ? std::wstring_view(*id)
+                           : std::wstring_view(defaultId.get());
+  if (device == nullptr && !state.endpoints.contains(key)) {
+    if (auto result = state.deviceEnumerator->GetDevice(
+            id->c_str(), std::out_ptr(device));
+        result == E_NOTFOUND)
+    {
+      return {};
+    } else {
+      PROPAGATE(checkCOM(result));
+    }
+  }
+
+  auto cached = state.endpoints.contains(key);
+  auto endpoint = AcquireEndpoint(state, hwnd, key, std::move(device));
+  PROPAGATE(endpoint);
+  TraceLoggingWrite(
+      traceProvider,
+      "DefaultEndpoint",
+      TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+      TraceLoggingCountedWideString(
+          key.data(), static_cast<USHORT>(key.size()), "DeviceId"),
+      TraceLoggingInt32(flow, "Flow"),
+      TraceLoggingBool(cached, "Cached"));
+  (*endpoint)->use(++state.endpointUses);
+  (*endpoint)->enforce(true);
+  defaultEndpoint = *endpoint;
+  if (flow == eRender) {
+    state.stats.publish(key);
+  }
+  if (!state.options.allEndpoints) {
+    PROPAGATE(EnumerateSessions(state, hwnd, **endpoint));
+  }
+  return ChangeAudio(state, **endpoint);
+}
+
+Result<> DropPendingDefault(State& state, HWND hwnd, EDataFlow flow)
+{
+  auto pendingDefault = std::move(state.pendingDefaults[flow]);
+  if (pendingDefault == nullptr) {
+    return {};
+  }
+
+  if (auto it = state.endpoints.find(*pendingDefault);
+      it != state.endpoints.end() && !state.options.allEndpoints
+      && !IsDefaultEndpoint(state, it->second))
+  {
+    it->second.enforce(false);
+  }
+
+  return checkWin32(KillTimer(hwnd, UserMessage::SettleTimer + flow) == 0);
+}
+
+Result<> ScheduleDefaultEndpoint(State& state,
+                                 HWND hwnd,
+                                 EDataFlow flow,
+                                 std::unique_ptr<std::wstring> id)
+{
+  auto endpoint =
+      id != nullptr ? state.endpoints.find(*id) : state.endpoints.end();
+  if (endpoint == state.endpoints.end()
+      || state.options.settleMilliseconds == 0)
+  {
+    // Activating a device is the expensive part and cannot wait, so there
+    // is nothing left to defer.
+    PROPAGATE(DropPendingDefault(state, hwnd, flow));
+    return SetDefaultEndpoint(state, hwnd, flow, id.get());
+  }
+
+  auto& pendingDefault = state.pendingDefaults[flow];
+  if (pendingDefault != nullptr) {
+    ++state.stats.avoidedResolutions;
+    if (*pendingDefault != *id) {
+      PROPAGATE(DropPendingDefault(state, hwnd, flow));
+    }
+  }
+
+  // Audio moves to the cached device right away, only the bookkeeping waits.
+  endpoint->second.use(++state.endpointUses);
+  endpoint->second.enforce(true);
+  PROPAGATE(EnumerateSessions(state, hwnd, endpoint->second));
+  PROPAGATE(ChangeAudio(state, endpoint->second));
+  pendingDefault = std::move(id);
+  return checkWin32(
+      SetTimer(hwnd,
+               UserMessage::SettleTimer + flow,
+               state.options.settleMilliseconds,
+               nullptr)
+      == 0);
+}
+
+Result<> UpdateEndpoint(State& state, HWND hwnd, std::wstring const& id)
+{
+  if (!state.options.allEndpoints && !state.endpoints.contains(id)) {
+    return {};
+  }
+
+  auto device = ComPtr<IMMDevice>();
+  if (auto result =
+          state.deviceEnumerator->GetDevice(id.c_str(), std::out_ptr(device));
+      result == E_NOTFOUND)
+  {
+    RemoveEndpoint(state, id);
+    return {};
+  } else {
+    PROPAGATE(checkCOM(result));
+  }
+
+  auto deviceState = DWORD {};
+  PROPAGATE(checkCOM(device->GetState(&deviceState)));
+  auto flow = EndpointFlow(device.get());
+  PROPAGATE(flow);
+  if (deviceState != DEVICE_STATE_ACTIVE
+      || !IsEnforcedFlow(state.options, *flow))
+  {
+    RemoveEndpoint(state, id);
+    return {};
+  }
+
+  if (!state.options.allEndpoints) {
+    return {};
+  }
+
+  auto endpoint = AcquireEndpoint(state, hwnd, id, std::move(device));
+  PROPAGATE(endpoint);
+  return ChangeAudio(state, **endpoint);
+}
+
+Result<> EnumerateEndpoints(State& state, HWND hwnd)
+{
+  auto collection = ComPtr<IMMDeviceCollection>();
+  PROPAGATE(checkCOM(state.deviceEnumerator->EnumAudioEndpoints(
+      state.options.capture ? eAll : eRender,
+      DEVICE_STATE_ACTIVE,
+      std::out_ptr(collection))));
+
+  auto count = UINT {};
+  PROPAGATE(checkCOM(collection->GetCount(&count)));
+  for (auto i = UINT {}; i != count; ++i) {
+    auto device = ComPtr<IMMDevice>();
+    PROPAGATE(checkCOM(collection->Item(i, std::out_ptr(device))));
+
+    auto id = CoTaskMemPtr<wchar_t>();
+    PROPAGATE(checkCOM(device->GetId(std::out_ptr(id))));
+    auto endpoint = AcquireEndpoint(state, hwnd, id.get(), std::move(device));
+    PROPAGATE(endpoint);
+    PROPAGATE(ChangeAudio(state, **endpoint));
+  }
+
+  return {};
+}
+
+bool IsTransientFailure(HRESULT result)
+{
+  return result == E_NOTFOUND || result == AUDCLNT_E_DEVICE_INVALIDATED
+      || result == AUDCLNT_E_SERVICE_NOT_RUNNING
+      || result == AUDCLNT_E_RESOURCES_INVALIDATED
+      || result == RPC_E_DISCONNECTED
+      || result == HRESULT_FROM_WIN32(RPC_S_SERVER_UNAVAILABLE)
+      || result == HRESULT_FROM_WIN32(RPC_S_CALL_FAILED);
+}
+
+void HandleFailure(State& state,
+                   HWND hwnd,
+                   HRESULT error,
+                   UINT retryMilliseconds = minRetryMilliseconds)
+{
+  auto transient = IsTransientFailure(error);
+  auto& failures = state.stats.failures;
+  (void)InterlockedIncrement(transient ? &failures.transient
+                                       : &failures.permanent);
+  (void)InterlockedExchange(&failures.last, error);
+  if (!transient && state.stats.recorder != nullptr && !state.dumped) {
+    state.dumped = true;
+    (void)DumpRecording(*state.stats.recorder, state.options.recordPath);
+  }
+
+  auto scheduled = transient && state.retryMilliseconds == 0;
+  if (scheduled) {
+    state.retryMilliseconds = retryMilliseconds;
+    scheduled = SetTimer(hwnd,
+                         UserMessage::RetryTimer,
+                         state.retryMilliseconds,
+                         nullptr)
+        != 0;
+    if (!scheduled) {
+      state.retryMilliseconds = 0;
+    }
+  }
+  TraceLoggingWrite(traceProvider,
+                    "Failure",
+                    TraceLoggingLevel(WINEVENT_LEVEL_WARNING),
+                    TraceLoggingHResult(error, "Result"),
+                    TraceLoggingBool(transient, "Transient"),
+                    TraceLoggingBool(scheduled, "RetryScheduled"),
+                    TraceLoggingUInt32(state.retryMilliseconds, "RetryMs"));
+}
+
+Result<> Resynchronize(State& state, HWND hwnd)
+{
+  if (state.paused) {
+    return {};
+  }
+
+  if (state.options.allEndpoints) {
+    state.sessions.clear();
+    state.endpoints.clear();
+    state.defaultEndpoints = {};
+    return EnumerateEndpoints(state, hwnd);
+  }
+
+  for (auto flow : {eRender, eCapture}) {
+    if (!IsEnforcedFlow(state.options, flow)) {
+      continue;
+    }
+
+    if (auto* endpoint = state.defaultEndpoints[flow]; endpoint != nullptr) {
+      auto byAddress = [&](auto const& entry)
+      { return &entry.second == endpoint; };
+      RemoveEndpoint(state, std::ranges::find_if(state.endpoints, byAddress));
+    }
+    PROPAGATE(SetDefaultEndpoint(state, hwnd, flow, nullptr));
+  }
+
+  return {};
+}
+
+void HandleAudioMessage(State& state,
+                        HWND hwnd,
+                        UINT message,
+                        WPARAM wParam,
+                        LPARAM lParam)
+{
+  auto result = Result<> {};
+  switch (message) {
+    case UserMessage::GetDefaultEndpoint: {
+      auto id = std::unique_ptr<std::wstring>(as_ptr<std::wstring>(lParam));
+      if (state.paused) {
+        break;
+      }
+
+      result = ScheduleDefaultEndpoint(
+          state, hwnd, static_cast<EDataFlow>(wParam), std::move(id));
+      break;
+    }
+    case UserMessage::ChangeAudio: {
+      auto dispatchedAt = performanceCounter();
+      auto handler = ComPtr<EndpointHandler>(as_ptr<EndpointHandler>(lParam));
+      auto notifiedAt = handler->acknowledge();
+
+      auto byHandler = [&](auto const& entry)
+      { return entry.second.handler() == handler.get(); };
+      auto it = std::ranges::find_if(state.endpoints, byHandler);
+      if (it == state.endpoints.end()) {
+        break;
+      }
+
+      auto& endpoint = it->second;
+      if (state.options.allEndpoints || IsDefaultEndpoint(state, endpoint)
+          || IsPendingDefault(state, it->first))
+      {
+        auto boost = ThreadBoost(state.inBackground);
+        result = ChangeAudio(state, endpoint);
+        state.stats.record(notifiedAt, dispatchedAt, performanceCounter());
+      }
+      break;
+    }
+    case UserMessage::SessionCreated: {
+      auto notification =
+          ComPtr<SessionNotification>(as_ptr<SessionNotification>(wParam));
+      auto session =
+          ComPtr<IAudioSessionControl>(as_ptr<IAudioSessionControl>(lParam));
+      if (state.paused) {
+        break;
+      }
+
+      auto byActivity = [&](auto const& entry)
+      { return entry.second.activityNotification() == notification.get(); };
+      if (auto it = std::ranges::find_if(state.endpoints, byActivity);
+          it != state.endpoints.end())
+      {
+        result = it->second.trackSessions(hwnd);
+        break;
+      }
+
+      auto byNotification = [&](auto const& entry)
+      { return entry.second.sessionNotification() == notification.get(); };
+      auto it = std::ranges::find_if(state.endpoints, byNotification);
+      if (it == state.endpoints.end()
+          || !(state.options.allEndpoints
+               || IsDefaultEndpoint(state, it->second)
+               || IsPendingDefault(state, it->first)))
+      {
+        break;
+      }
+
+      result = AddSession(state, hwnd, it->second, session.get());
+      break;
+    }
+    case UserMessage::ChangeSession: {
+      auto handler = ComPtr<SessionHandler>(as_ptr<SessionHandler>(lParam));
+      handler->acknowledge();
+
+      auto boost = ThreadBoost(state.inBackground);
+      result = ChangeSession(state, handler.get());
+      break;
+    }
+    case UserMessage::HardwareMuteChanged: {
+      auto handler = ComPtr<TopologyHandler>(as_ptr<TopologyHandler>(lParam));
+      handler->acknowledge();
+
+      auto byHandler = [&](auto const& entry)
+      {
+        auto* hardwareMute = entry.second.hardwareMute();
+        return hardwareMute != nullptr
+            && hardwareMute->handler() == handler.get();
+      };
+      auto it = std::ranges::find_if(state.endpoints, byHandler);
+      if (it == state.endpoints.end()) {
+        break;
+      }
+
+      auto& endpoint = it->second;
+      if (state.options.allEndpoints || IsDefaultEndpoint(state, endpoint)
+          || IsPendingDefault(state, it->first))
+      {
+        auto boost = ThreadBoost(state.inBackground);
+        result = ChangeAudio(state, endpoint);
+      }
+      break;
+    }
+    case UserMessage::EnumerateEndpoints: {
+      if (!state.paused) {
+        result = EnumerateEndpoints(state, hwnd);
+      }
+      break;
+    }
+    case UserMessage::EndpointChanged: {
+      auto id = std::unique_ptr<std::wstring>(as_ptr<std::wstring>(lParam));
+
+      if (id != nullptr && !state.paused) {
+        result = UpdateEndpoint(state, hwnd, *id);
+      }
+      break;
+    }
+    case UserMessage::EnterBackground:
+      result = EnterBackground(state.inBackground);
+      break;
+    case UserMessage::PolicyChanged: {
+      result = checkWin32(SetTimer(hwnd,
+                                   UserMessage::ReloadTimer,
+                                   policyReloadMilliseconds,
+                                   nullptr)
+                          == 0);
+      break;
+    }
+  }
+
+  if (!result) {
+    HandleFailure(state, hwnd, result.error());
+  }
+
+  state.stats.publish();
+}
+
+Result<> ReloadPolicies(State& state, HWND hwnd)
+{
+  auto policies = PolicyTable();
+  try {
+    policies = LoadPolicyTable(state.options.configPath);
+  } catch (std::exception const& error) {
+    TraceLoggingWrite(traceProvider,
+                      "ReloadPolicyTableFailed",
+                      TraceLoggingLevel(WINEVENT_LEVEL_WARNING),
+                      TraceLoggingString(error.what(), "Reason"));
+    return {};
+  }
+
+  state.policies = std::move(policies);
+
+  auto rebuild = std::vector<std::wstring>();
+  for (auto& [id, endpoint] : state.endpoints) {
+    if (auto policy = state.policies.find(id);
+        policy.ignore != endpoint.policy().ignore
+        || (state.options.topology
+            && (policy.level == 0.0f) != (endpoint.policy().level == 0.0f)))
+    {
+      rebuild.push_back(id);
+    } else {
+      endpoint.configure(policy);
+      auto [first, last] = state.sessions.equal_range(&endpoint);
+      for (; first != last; ++first) {
+        PROPAGATE(IgnoreInvalidatedDevice(
+            first->second.limit(policy.level, state.guid)));
+      }
+    }
+  }
+
+  auto resolveDefaults = std::array<bool, 2> {};
+  for (auto const& id : rebuild) {
+    auto it = state.endpoints.find(id);
+    for (auto flow : {eRender, eCapture}) {
+      resolveDefaults[flow] |= &it->second == state.defaultEndpoints[flow];
+    }
+    RemoveEndpoint(state, it);
+    if (state.options.allEndpoints) {
+      PROPAGATE(UpdateEndpoint(state, hwnd, id));
+    }
+  }
+
+  if (state.options.allEndpoints) {
+    for (auto& [id, endpoint] : state.endpoints) {
+      PROPAGATE(ChangeAudio(state, endpoint));
+    }
+    return {};
+  }
+
+  for (auto flow : {eRender, eCapture}) {
+    if (resolveDefaults[flow]) {
+      PROPAGATE(SetDefaultEndpoint(state, hwnd, flow, nullptr));
+    } else if (auto* endpoint = state.defaultEndpoints[flow];
+               endpoint != nullptr)
+    {
+      PROPAGATE(ChangeAudio(state, *endpoint));
+    }
+  }
+
+  return {};
+}
+
+void HandleAudioTimer(State& state, HWND hwnd, UINT_PTR timer)
+{
+  auto result = Result<> {};
+  switch (timer) {
+    case UserMessage::SettleTimer + eRender:
+    case UserMessage::SettleTimer + eCapture: {
+      auto flow = static_cast<EDataFlow>(timer - UserMessage::SettleTimer);
+      auto& pendingDefault = state.pendingDefaults[flow];
+      if (pendingDefault == nullptr) {
+        break;
+      }
+
+      (void)KillTimer(hwnd, timer);
+      auto id = std::move(pendingDefault);
+      TraceLoggingWrite(traceProvider,
+                        "DefaultEndpointSettled",
+                        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+                        TraceLoggingInt32(flow, "Flow"),
+                        TraceLoggingInt32(state.stats.avoidedResolutions,
+                                          "AvoidedResolutions"));
+      result = SetDefaultEndpoint(state, hwnd, flow, id.get());
+      break;
+    }
+    case UserMessage::ReloadTimer:
+      (void)KillTimer(hwnd, timer);
+      result = ReloadPolicies(state, hwnd);
+      break;
+    case UserMessage::RetryTimer: {
+      (void)KillTimer(hwnd, timer);
+      auto retryMilliseconds = std::exchange(state.retryMilliseconds, 0);
+      (void)InterlockedIncrement(&state.stats.failures.retries);
+      if (result = Resynchronize(state, hwnd); !result) {
+        HandleFailure(
+            state,
+            hwnd,
+            result.error(),
+            std::min(retryMilliseconds * 2, maxRetryMilliseconds));
+        return;
+      }
+      break;
+    }
+  }
+
+  if (!result) {
+    HandleFailure(state, hwnd, result.error());
+  }
+
+  state.stats.publish();
+}
+
+void PauseEnforcement(State& state, HWND hwnd)
+{
+  state.paused = true;
+  for (auto flow : {eRender, eCapture}) {
+    if (state.pendingDefaults[flow] != nullptr) {
+      (void)KillTimer(hwnd, UserMessage::SettleTimer + flow);
+      state.pendingDefaults[flow].reset();
+    }
+  }
+
+  state.sessions.clear();
+  state.defaultEndpoints = {};
+  state.endpoints.clear();
+  state.stats.publish(L""sv);
+}
+
+// Each raise credits the processes whose sessions were active when its
+// notification arrived. Sessions are only tracked after the first query.
+Result<> AttributeRaises(State& state, HWND hwnd)
+{
+  for (auto& [id, endpoint] : state.endpoints) {
+    endpoint.handler()->takeRaises(
+        [&](DWORD processId, LONG raises)
+        { state.stats.attribute(processId, raises); });
+    if (!state.attributing) {
+      PROPAGATE(endpoint.trackSessions(hwnd));
+    }
+  }
+
+  state.attributing = true;
+  state.stats.publishRaises();
+  return {};
+}
+
+LRESULT HandleRemoteCommand(State& state, HWND hwnd, RemoteCommand command)
+{
+  auto result = Result<> {};
+  switch (command) {
+    case RemoteCommand::Pause:
+      if (!state.paused) {
+        PauseEnforcement(state, hwnd);
+      }
+      break;
+    case RemoteCommand::Resume:
+      if (state.paused) {
+        state.paused = false;
+        result = Resynchronize(state, hwnd);
+      }
+      break;
+    case RemoteCommand::Query:
+      result = AttributeRaises(state, hwnd);
+      break;
+    case RemoteCommand::Resync:
+      result = Resynchronize(state, hwnd);
+      break;
+    case RemoteCommand::Stop:
+      result = checkWin32(PostMessageW(hwnd, WM_CLOSE, 0, 0) == 0);
+      break;
+    case RemoteCommand::Dump:
+      if (state.stats.recorder == nullptr) {
+        return RemoteReply::Rejected;
+      }
+      result = DumpRecording(*state.stats.recorder, state.options.recordPath);
+      break;
+    default:
+      return RemoteReply::Rejected;
+  }
+
+  TraceLoggingWrite(traceProvider,
+                    "RemoteCommand",
+                    TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+                    TraceLoggingUInt64(std::to_underlying(command), "Command"),
+                    TraceLoggingBool(state.paused, "Paused"));
+  if (!result) {
+    HandleFailure(state, hwnd, result.error());
+  }
+
+  state.stats.publish();
+  return state.paused ? RemoteReply::Paused : RemoteReply::Enforcing;
+}
+
+int RunMessageLoop(State& state, HWND hwnd)
+{
+  auto msg = MSG {};
+  while (true) {
+    auto count = state.pollTimer != nullptr ? DWORD {1} : DWORD {};
+    auto wait = MsgWaitForMultipleObjectsEx(
+        count, &state.pollTimer, INFINITE, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+    throwIf(wait == WAIT_FAILED);
+    if (count != 0 && wait == WAIT_OBJECT_0) {
+      if (auto result = PollEndpoints(state); !result) {
+        HandleFailure(state, hwnd, result.error());
+      }
+      state.stats.publish();
+      continue;
+    }
+
+    while (PeekMessageW(&msg, nullptr, 0, 0, PM_REMOVE) != 0) {
+      if (msg.message == WM_QUIT) {
+        return static_cast<int>(msg.wParam);
+      }
+
+      (void)DispatchMessageW(&msg);
+    }
+  }
+}
+
+void StartEnforcement(HWND window, Options const& options)
+{
+  if (options.allEndpoints) {
+    throwIf(PostMessageW(window, UserMessage::EnumerateEndpoints, 0, 0) == 0);
+    return;
+  }
+
+  for (auto flow : {eRender, eCapture}) {
+    if (IsEnforcedFlow(options, flow)) {
+      throwIf(
+          PostMessageW(window, UserMessage::GetDefaultEndpoint, flow, 0) == 0);
+    }
+  }
+}
+
+LRESULT CALLBACK AudioWndProc(  //
+    HWND hwnd,
+    UINT message,
+    WPARAM wParam,
+    LPARAM lParam)
+{
+  switch (message) {
+    case WM_CREATE: {
+      auto* state = as_ptr<CREATESTRUCT>(lParam)->lpCreateParams;
+      SetLastError(0);
+      if (SetWindowLongPtrW(
+              hwnd, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(state))
+          != 0)
+      {
+        break;
+      }
+      throwIf(GetLastError() != 0);
+      break;
+    }
+    case UserMessage::GetDefaultEndpoint:
+    case UserMessage::ChangeAudio:
+    case UserMessage::SessionCreated:
+    case UserMessage::ChangeSession:
+    case UserMessage::EnumerateEndpoints:
+    case UserMessage::EndpointChanged:
+    case UserMessage::EnterBackground:
+    case UserMessage::PolicyChanged:
+    case UserMessage::HardwareMuteChanged: {
+      auto userData = GetWindowLongPtrW(hwnd, GWLP_USERDATA);
+      throwIf(userData == 0);
+
+      HandleAudioMessage(
+          *as_ptr<State>(userData), hwnd, message, wParam, lParam);
+      break;
+    }
+    case UserMessage::DrainCommands: {
+      auto userData = GetWindowLongPtrW(hwnd, GWLP_USERDATA);
+      throwIf(userData == 0);
+
+      auto& state = *as_ptr<State>(userData);
+      if (state.commands != nullptr) {
+        state.commands->drain(
+            [&](RemoteCommand command)
+            { (void)HandleRemoteCommand(state, hwnd, command); });
+      }
+      break;
+    }
+    case WM_TIMER: {
+      auto userData = GetWindowLongPtrW(hwnd, GWLP_USERDATA);
+      throwIf(userData == 0);
+
+      HandleAudioTimer(*as_ptr<State>(userData), hwnd, wParam);
+      break;
+    }
+    case WM_COPYDATA: {
+      auto userData = GetWindowLongPtrW(hwnd, GWLP_USERDATA);
+      throwIf(userData == 0);
+
+      // Stop is only ever queued by the tray of this process.
+      auto const& data = *as_ptr<COPYDATASTRUCT>(lParam);
+      if (data.dwData > std::to_underlying(RemoteCommand::Resync)) {
+        return RemoteReply::Rejected;
+      }
+
+      return HandleRemoteCommand(*as_ptr<State>(userData),
+                                 hwnd,
+                                 static_cast<RemoteCommand>(data.dwData));
+    }
+    case WM_CLOSE:
+      throwIf(DestroyWindow(hwnd) == 0);
+      break;
+    case WM_DESTROY:
+      PostQuitMessage(0);
+      break;
+  }
+
+  return DefWindowProcW(hwnd, message, wParam, lParam);
+}
+
+struct StatsAttachment
+{
+  Stats* stats {};
+
+  StatsAttachment(Stats& stats, SharedStats* shared, EventRecorder* recorder)
+      : stats(&stats)
+  {
+    stats.shared = shared;
+    stats.recorder = recorder;
+  }
+
+  StatsAttachment(StatsAttachment&&) = delete;
+
+  ~StatsAttachment()
+  {
+    stats->shared = nullptr;
+    stats->recorder = nullptr;
+  }
+};
+
+class NotificationRegistration
+{
+  IMMDeviceEnumerator* deviceEnumerator {};
+  ComPtr<NotificationClient> client;
+
+public:
+  NotificationRegistration(IMMDeviceEnumerator* deviceEnumerator,
+                           ComPtr<NotificationClient> client)
+      : deviceEnumerator(deviceEnumerator)
+      , client(std::move(client))
+  {
+    throwIfCOM(deviceEnumerator->RegisterEndpointNotificationCallback(
+        this->client.get()));
+  }
+
+  NotificationRegistration(NotificationRegistration&&) = delete;
+
+  ~NotificationRegistration()
+  {
+    if (FAILED(deviceEnumerator->UnregisterEndpointNotificationCallback(
+            client.get())))
+    {
+      outputStacktrace();
+      OutputDebugStringW(L"UnregisterEndpointNotificationCallback failed\n");
+    }
+  }
+};
+
+int RunAudio(HINSTANCE hInstance,
+             Options const& options,
+             Stats& stats,
+             CommandQueue* commands,
+             auto&& started)
+{
+  throwIfCOM(CoInitializeEx(nullptr, COINIT_MULTITHREADED));
+  auto mmcss = MmcssRegistration(options.mmcssTask);
+
+  auto guid = GUID {};
+  throwIfCOM(CoCreateGuid(&guid));
+
+  auto deviceEnumerator = ComPtr<IMMDeviceEnumerator>();
+  throwIfCOM(CoCreateInstance(  //
+      __uuidof(MMDeviceEnumerator),
+      nullptr,
+      CLSCTX_INPROC_SERVER,
+      __uuidof(IMMDeviceEnumerator),
+      std::out_ptr(deviceEnumerator)));
+
+  auto audioWindowClass = WNDCLASSW  //
+      {.lpfnWndProc = AudioWndProc,
+       .hInstance = hInstance,
+       .lpszClassName = audioClassName};
+  auto audioAtom = RegisterClassW(&audioWindowClass);
+  throwIf(audioAtom == 0);
+
+  auto statsBlock = StatsBlock(options);
+  auto recorder = std::optional<EventRecorder>();
+  if (!options.recordPath.empty()) {
+    recorder.emplace();
+  }
+  auto attachment =
+      StatsAttachment(stats, statsBlock.get(), recorder ? &*recorder : nullptr);
+  auto state = State  //
+      {.hInstance = hInstance,
+       .guid = &guid,
+       .deviceEnumerator = deviceEnumerator.get(),
+       .commands = commands,
+       .options = options,
+       .policies = LoadPolicyTable(options.configPath),
+       .stats = stats};
+  auto window = CreateWindowW(  //
+      MAKEINTATOM(audioAtom),
+      L"Message only",
+      0,
+      0,
+      0,
+      0,
+      0,
+      HWND_MESSAGE,
+      nullptr,
+      hInstance,
+      &state);
+  throwIf(window == nullptr);
+
+  auto notifications = NotificationRegistration(
+      deviceEnumerator.get(),
+      makeComObject<NotificationClient>(window, state.options, state.stats));
+  auto policyWatcher = PolicyWatcher(options.configPath, window);
+  auto pollTimer = Handle(nullptr);
+  if (options.pollMilliseconds != 0) {
+    pollTimer.handle =
+        CreateWaitableTimerExW(nullptr, nullptr, 0, TIMER_ALL_ACCESS);
+    throwIf(pollTimer.handle == nullptr);
+    state.pollTimer = pollTimer.handle;
+  }
+
+  auto msg = MSG {};
+  (void)PeekMessageW(&msg, window, 0, 0, PM_NOREMOVE);
+  StartEnforcement(window, options);
+  if (options.background) {
+    throwIf(PostMessageW(window, UserMessage::EnterBackground, 0, 0) == 0);
+  }
+
+  if (commands != nullptr) {
+    commands->attach(window);
+  }
+  started(state);
+  try {
+    return RunMessageLoop(state, window);
+  } catch (...) {
+    if (recorder && !state.dumped) {
+      (void)DumpRecording(*recorder, options.recordPath);
+    }
+    throw;
+  }
+}
+
+}  // namespace
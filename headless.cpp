@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-3.0
+
+#include <exception>
+
+#include <Windows.h>
+
+#include "core.hpp"
+
+namespace
+{
+
+int TryMain(HINSTANCE hInstance)
+{
+  auto options = ParseOptions();
+  if (options.command != RemoteCommand::None) {
+    return SendRemoteCommand(options.command);
+  }
+
+  auto traceRegistration = TraceRegistration();
+
+  // Redirected audio of a remote session plays on that session's own
+  // "Remote Audio" endpoint, which other sessions cannot see, so each
+  // session needs its own instance. --global is only for hosts that enforce
+  // console or physical endpoints from a single copy.
+  auto mutex =
+      Handle(CreateMutexW(nullptr, FALSE, InstanceMutexName(options)));
+  if (GetLastError() == ERROR_ALREADY_EXISTS) {
+    return 0;
+  }
+
+  auto stats = Stats {};
+  return RunAudio(hInstance, options, stats, nullptr, [](State&) {});
+}
+
+}  // namespace
+
+int WINAPI wWinMain(  //
+    _In_ HINSTANCE hInstance,
+    _In_opt_ HINSTANCE,
+    _In_ LPWSTR,
+    _In_ int)
+{
+  try {
+    return TryMain(hInstance);
+  } catch (com_error const& error) {
+    outputSystemError(static_cast<DWORD>(error.code()));
+  } catch (std::exception const& error) {
+    OutputDebugStringA(error.what());
+    OutputDebugStringW(L"\n");
+  }
+
+  return 1;
+}
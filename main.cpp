@@ -5,399 +5,91 @@
 #include <bit>
 #include <cstdint>
 #include <exception>
-#include <iostream>
+#include <format>
 #include <iterator>
-#include <limits>
 #include <memory>
-#include <new>
-#include <ranges>
-#include <stacktrace>
+#include <optional>
 #include <stdexcept>
+#include <stop_token>
+#include <string>
 #include <string_view>
-#include <system_error>
+#include <thread>
 #include <type_traits>
 #include <utility>
 
 #include <Richedit.h>
 #include <Windows.h>
-#include <endpointvolume.h>
-#include <mmdeviceapi.h>
-#include <objbase.h>
 #include <shellapi.h>
 
-#define PRECONDITION(x) \
-  do { \
-    if (!(x)) { \
-      throw std::runtime_error("Precondition [ " #x " ] not met"); \
-    } \
-  } while (false)
-
-using namespace std::string_view_literals;
+#include "core.hpp"
+#include "resource.h"
 
 namespace
 {
 
-class com_error : public std::exception
-{
-  HRESULT _code;
-
-public:
-  explicit com_error(HRESULT code) : _code(code) {}
-
-  HRESULT code() const { return _code; }
-};
-
-void outputSystemError(DWORD error = GetLastError())
-{
-  constexpr auto bufferSize = DWORD {4096};
-  auto buffer = std::array<wchar_t, bufferSize>();
-  auto charactersWrittenWithoutNull = FormatMessageW(  //
-      FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-      nullptr,
-      error,
-      MAKELANGID(LANG_NEUTRAL, SUBLANG_NEUTRAL),
-      buffer.data(),
-      bufferSize,
-      nullptr);
-  if (charactersWrittenWithoutNull != 0) {
-    auto it = buffer.begin() + charactersWrittenWithoutNull;
-    auto tail = L"\n\0"sv;
-    if (auto distance = static_cast<std::size_t>(buffer.end() - it);
-        tail.size() > distance)
-    {
-      tail.remove_prefix(tail.size() - distance);
-    }
-    (void)std::ranges::copy(tail, it);
-    OutputDebugStringW(buffer.data());
-  } else {
-    OutputDebugStringW(L"Can't get error message\n");
-  }
-}
-
-[[noreturn]] void throw_(
-    DWORD error, std::stacktrace stacktrace = std::stacktrace::current())
-{
-  std::cerr << stacktrace << '\n';
-  throw std::system_error(static_cast<int>(error), std::system_category());
-}
-
-void throwIf(bool condition,
-             DWORD error,
-             std::stacktrace stacktrace = std::stacktrace::current())
-{
-  if (condition) {
-    throw_(error, stacktrace);
-  }
-}
-
-void throwIf(bool condition,
-             std::stacktrace stacktrace = std::stacktrace::current())
-{
-  throwIf(condition, GetLastError(), stacktrace);
-}
-
-void throwIfCOM(HRESULT result,
-                std::stacktrace stacktrace = std::stacktrace::current())
-{
-  if (FAILED(result)) {
-    std::cerr << stacktrace << '\n';
-    throw com_error(result);
-  }
-}
-
-template<typename T>
-T* as_ptr(auto value)
-{
-  return std::launder(reinterpret_cast<T*>(value));
-}
-
-struct UserMessage
-{
-  enum enum_ : UINT
-  {
-    TrayIcon = WM_USER,
-    GetDefaultEndpoint,
-    ChangeAudio,
-  };
-  static constexpr WORD TrayLicense = 1;
-  static constexpr WORD TrayExit = 2;
-};
-
-template<typename Derived, typename Base>
-concept DerivedFrom = std::is_base_of_v<Base, Derived>;
-
-struct ComPtrDeleter
-{
-  void operator()(IUnknown* ptr)
-  {
-    if (ptr != nullptr) {
-      ptr->Release();
-    }
-  }
-};
-
-template<DerivedFrom<IUnknown> T>
-using ComPtr = std::unique_ptr<T, ComPtrDeleter>;
-
-struct Handle
-{
-  HANDLE handle {};
-
-  explicit Handle(HANDLE handle)
-      : handle(handle)
-  {
-  }
-
-  Handle(Handle&&) = delete;
-
-  ~Handle()
-  {
-    if (handle != nullptr && CloseHandle(handle) == 0) {
-      std::cerr << std::stacktrace::current() << '\n';
-      outputSystemError();
-    }
-  }
-};
-
-struct Library
-{
-  HINSTANCE library {};
-
-  explicit Library(LPCWSTR name)
-      : library(LoadLibraryW(name))
-  {
-    throwIf(library == nullptr);
-  }
-
-  Library(Library&&) = delete;
-
-  ~Library()
-  {
-    if (library != nullptr && FreeLibrary(library) == 0) {
-      std::cerr << std::stacktrace::current() << '\n';
-      outputSystemError();
-    }
-  }
-};
-
 class TrayIcon
 {
-  NOTIFYICONDATAW* iconData {};
+  NOTIFYICONDATAW _data {};
+  bool _added {};
 
 public:
-  explicit TrayIcon(NOTIFYICONDATAW& iconData)
-      : iconData(&iconData)
+  explicit TrayIcon(NOTIFYICONDATAW const& data)
+      : _data(data)
   {
-    throwIf(Shell_NotifyIconW(NIM_ADD, &iconData) == FALSE);
   }
 
   TrayIcon(TrayIcon&&) = delete;
 
   ~TrayIcon()
   {
-    if (Shell_NotifyIconW(NIM_DELETE, iconData) == FALSE) {
-      std::cerr << std::stacktrace::current() << '\n';
+    if (_added && Shell_NotifyIconW(NIM_DELETE, &_data) == FALSE) {
+      outputStacktrace();
       OutputDebugStringW(L"Shell_NotifyIconW(NIM_DELETE) failed\n");
     }
   }
-};
-
-template<DerivedFrom<IUnknown> T>
-class ComCallback
-{
-  T* callback;
-
-public:
-  template<typename... Args>
-  explicit ComCallback(Args&&... args)
-      : callback(new T(std::forward<Args>(args)...))
-  {
-  }
-
-  ~ComCallback()
-  {
-    if (std::uncaught_exceptions() != 0) {
-      callback->Release();
-    }
-  }
-
-  operator T*() { return callback; }
-};
-
-class EndpointHandler : public IAudioEndpointVolumeCallback
-{
-  ULONG refCount {};
-  GUID* guid {};
-  HWND window {};
-
-  virtual ~EndpointHandler() {}
-
-public:
-  EndpointHandler(GUID& guid, HWND window)
-      : guid(&guid)
-      , window(window)
-  {
-  }
-
-  EndpointHandler(EndpointHandler&&) = delete;
-
-  ULONG STDMETHODCALLTYPE AddRef() override
-  {
-    PRECONDITION(refCount != std::numeric_limits<ULONG>::max());
-    return InterlockedIncrement(&refCount);
-  }
-
-  ULONG STDMETHODCALLTYPE Release() override
-  {
-    PRECONDITION(refCount > 0);
-    auto result = InterlockedDecrement(&refCount);
-    if (result == 0) {
-      delete this;
-    }
-    return result;
-  }
-
-  HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid,
-                                           void** ppvObject) override
-  {
-    if (ppvObject == nullptr) {
-      return E_POINTER;
-    }
-
-    if (__uuidof(IUnknown) != riid
-        || __uuidof(IAudioEndpointVolumeCallback) != riid)
-    {
-      *ppvObject = nullptr;
-      return E_NOINTERFACE;
-    }
-
-    AddRef();
-    *ppvObject = this;
-    return S_OK;
-  }
-
-  HRESULT STDMETHODCALLTYPE
-  OnNotify(PAUDIO_VOLUME_NOTIFICATION_DATA data) override
-  {
-    if (data == nullptr) {
-      return E_POINTER;
-    }
-
-    if (data->guidEventContext != *guid) {
-      if (PostMessageW(window, UserMessage::ChangeAudio, 0, 0) == 0) {
-        auto error = GetLastError();
-        return __HRESULT_FROM_WIN32(error);
-      }
-    }
-
-    return S_OK;
-  }
-};
-
-class NotificationClient : public IMMNotificationClient
-{
-  ULONG refCount {};
-  HWND window {};
-
-  virtual ~NotificationClient() {}
-
-public:
-  explicit NotificationClient(HWND window)
-      : window(window)
-  {
-  }
-
-  NotificationClient(NotificationClient&&) = delete;
-
-  ULONG STDMETHODCALLTYPE AddRef() override
-  {
-    PRECONDITION(refCount != std::numeric_limits<ULONG>::max());
-    return InterlockedIncrement(&refCount);
-  }
-
-  ULONG STDMETHODCALLTYPE Release() override
-  {
-    PRECONDITION(refCount > 0);
-    auto result = InterlockedDecrement(&refCount);
-    if (result == 0) {
-      delete this;
-    }
-    return result;
-  }
-
-  HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid,
-                                           void** ppvObject) override
-  {
-    if (ppvObject == nullptr) {
-      return E_POINTER;
-    }
 
-    if (__uuidof(IUnknown) != riid || __uuidof(IMMNotificationClient) != riid) {
-      *ppvObject = nullptr;
-      return E_NOINTERFACE;
-    }
+  NOTIFYICONDATAW& data() { return _data; }
 
-    AddRef();
-    *ppvObject = this;
-    return S_OK;
-  }
+  bool added() const { return _added; }
 
-  HRESULT STDMETHODCALLTYPE OnDefaultDeviceChanged(EDataFlow flow,
-                                                   ERole role,
-                                                   LPCWSTR) override
+  bool add()
   {
-    if (flow != eRender || role != eConsole) {
-      return S_OK;
+    if (_added && Shell_NotifyIconW(NIM_MODIFY, &_data) != FALSE) {
+      return true;
     }
 
-    if (PostMessageW(window, UserMessage::GetDefaultEndpoint, 0, 0) == 0) {
-      auto error = GetLastError();
-      return __HRESULT_FROM_WIN32(error);
-    }
-
-    return S_OK;
-  }
-
-  HRESULT STDMETHODCALLTYPE OnDeviceStateChanged(LPCWSTR, DWORD) override
-  {
-    return S_OK;
-  }
-
-  HRESULT STDMETHODCALLTYPE OnDeviceAdded(LPCWSTR) override { return S_OK; }
-
-  HRESULT STDMETHODCALLTYPE OnDeviceRemoved(LPCWSTR) override { return S_OK; }
-
-  HRESULT STDMETHODCALLTYPE OnPropertyValueChanged(  //
-      LPCWSTR,
-      const PROPERTYKEY) override
-  {
-    return S_OK;
+    _added = Shell_NotifyIconW(NIM_ADD, &_data) != FALSE;
+    return _added;
   }
 };
 
 void ShowContextMenu(HWND hwnd)
 {
   auto popup = CreatePopupMenu();
-  throwIf(popup == nullptr);
-
-  throwIf(InsertMenuW(popup,
-                      0,
-                      MF_BYPOSITION | MF_STRING,
-                      UserMessage::TrayLicense,
-                      L"License")
-          == 0);
-
-  throwIf(
-      InsertMenuW(
-          popup, 1, MF_BYPOSITION | MF_STRING, UserMessage::TrayExit, L"Exit")
-      == 0);
+  if (popup == nullptr) {
+    return;
+  }
 
-  (void)SetForegroundWindow(hwnd);
+  auto items = std::array<std::pair<UINT_PTR, LPCWSTR>, 4> {{
+      {UserMessage::TrayLicense, L"License"},
+      {UserMessage::TrayResync, L"Resynchronize"},
+      {UserMessage::TrayRaises, L"Volume raises"},
+      {UserMessage::TrayExit, L"Exit"},
+  }};
+  auto inserted = true;
+  for (auto position = UINT {}; auto const& [id, text] : items) {
+    inserted = inserted
+        && InsertMenuW(popup, position++, MF_BYPOSITION | MF_STRING, id, text)
+            != 0;
+  }
 
   auto point = POINT {};
-  throwIf(GetCursorPos(&point) == 0);
+  if (inserted && GetCursorPos(&point) != 0) {
+    (void)SetForegroundWindow(hwnd);
+    (void)TrackPopupMenu(popup, 0, point.x, point.y, 0, hwnd, nullptr);
+  }
 
-  throwIf(TrackPopupMenu(popup, 0, point.x, point.y, 0, hwnd, nullptr) == 0);
+  (void)DestroyMenu(popup);
 }
 
 class LicenseDialogData
@@ -506,16 +198,6 @@ public:
   }
 };
 
-struct State
-{
-  HINSTANCE hInstance {};
-  HWND dialog {};
-  GUID* guid {};
-  IMMDeviceEnumerator* deviceEnumerator {};
-  ComPtr<IMMDevice> audioDevice {};
-  ComPtr<IAudioEndpointVolume> endpointVolume {};
-};
-
 #define GPL_URL L"https://www.gnu.org/licenses/"
 
 wchar_t const* gplNotice =
@@ -603,10 +285,152 @@ INT_PTR CALLBACK DialogProc(  //
   return FALSE;
 }
 
-void ChangeAudio(State& state)
+struct AudioThread
+{
+  HINSTANCE hInstance {};
+  Options const* options {};
+  HWND tray {};
+  CommandQueue commands {};
+  Handle started {CreateEventW(nullptr, TRUE, FALSE, nullptr)};
+  Stats stats {};
+  bool running {};
+  int exitCode {1};
+};
+
+void RunAudioThread(std::stop_token stop, AudioThread& audio)
+{
+  auto stopCallback = std::stop_callback(
+      stop, [&] { audio.commands.push(RemoteCommand::Stop); });
+  try {
+    audio.exitCode = RunAudio(audio.hInstance,
+                              *audio.options,
+                              audio.stats,
+                              &audio.commands,
+                              [&](State&)
+                              {
+                                audio.running = true;
+                                throwIf(SetEvent(audio.started.handle) == 0);
+                              });
+  } catch (com_error const& error) {
+    outputSystemError(static_cast<DWORD>(error.code()));
+  } catch (std::exception const& error) {
+    OutputDebugStringA(error.what());
+    OutputDebugStringW(L"\n");
+  }
+
+  (void)SetEvent(audio.started.handle);
+  (void)PostMessageW(audio.tray, WM_CLOSE, 0, 0);
+}
+
+struct Tray
 {
-  throwIfCOM(
-      state.endpointVolume->SetMasterVolumeLevelScalar(0.0f, state.guid));
+  HINSTANCE hInstance {};
+  HWND dialog {};
+  TrayIcon* icon {};
+  std::optional<Library> richEdit {};
+  AudioThread* audio {};
+};
+
+void UpdateTooltip(Tray& tray)
+{
+  if (!tray.icon->added()) {
+    return;
+  }
+
+  auto& iconData = tray.icon->data();
+  auto tip = std::array<wchar_t, std::extent_v<decltype(iconData.szTip)>> {};
+  auto const& stats = tray.audio->stats;
+  (void)std::format_to_n(tip.data(),
+                         tip.size() - 1,
+                         L"AlwaysMute\n"
+                         L"Coalesced/suppressed: {}/{}\n"
+                         L"Queue p50/p99/max: {}/{}/{} us\n"
+                         L"Mute p50/p99/max: {}/{}/{} us\n"
+                         L"Startup: {} ms",
+                         ReadNoFence(&stats.coalescedNotifications),
+                         ReadNoFence(&stats.suppressedCalls),
+                         stats.queueLatency.percentile(500),
+                         stats.queueLatency.percentile(990),
+                         stats.queueLatency.max(),
+                         stats.muteLatency.percentile(500),
+                         stats.muteLatency.percentile(990),
+                         stats.muteLatency.max(),
+                         ReadNoFence64(&stats.firstMuteMicroseconds) / 1000);
+  if (std::ranges::equal(tip, iconData.szTip)) {
+    return;
+  }
+
+  (void)std::ranges::copy(tip, iconData.szTip);
+  (void)Shell_NotifyIconW(NIM_MODIFY, &iconData);
+}
+
+std::wstring ProcessName(DWORD processId)
+{
+  if (processId == 0) {
+    return L"No active session";
+  }
+
+  auto process = Handle(
+      OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId));
+  auto path = std::array<wchar_t, MAX_PATH> {};
+  auto size = static_cast<DWORD>(path.size());
+  if (process.handle == nullptr
+      || QueryFullProcessImageNameW(process.handle, 0, path.data(), &size)
+          == 0)
+  {
+    return std::format(L"Process {}", processId);
+  }
+
+  auto name = std::wstring_view(path.data(), size);
+  return std::format(
+      L"{} ({})", name.substr(name.find_last_of(L'\\') + 1), processId);
+}
+
+void ShowRaises(Tray& tray, HWND hwnd)
+{
+  auto raises = std::array<ProcessRaises, attributionCapacity> {};
+  (void)std::ranges::transform(
+      tray.audio->stats.raises,
+      raises.begin(),
+      [](ProcessRaises const& entry)
+      {
+        return ProcessRaises {entry.processId, ReadNoFence(&entry.raises)};
+      });
+  std::ranges::sort(raises, std::ranges::greater(), &ProcessRaises::raises);
+
+  auto text = std::wstring();
+  for (auto const& entry : raises) {
+    if (entry.raises != 0) {
+      std::format_to(std::back_inserter(text),
+                     L"{}: {}\n",
+                     ProcessName(entry.processId),
+                     entry.raises);
+    }
+  }
+
+  (void)MessageBoxW(hwnd,
+                    text.empty() ? L"No volume raises" : text.c_str(),
+                    L"Processes active during volume raises",
+                    MB_OK | MB_ICONINFORMATION);
+}
+
+constexpr UINT trayRetryMilliseconds = 1000;
+
+UINT TaskbarCreatedMessage()
+{
+  static auto const message = RegisterWindowMessageW(L"TaskbarCreated");
+  return message;
+}
+
+void AddTrayIcon(Tray& tray, HWND hwnd)
+{
+  if (tray.icon->add()) {
+    (void)KillTimer(hwnd, UserMessage::TrayRetryTimer);
+    return;
+  }
+
+  (void)SetTimer(
+      hwnd, UserMessage::TrayRetryTimer, trayRetryMilliseconds, nullptr);
 }
 
 LRESULT CALLBACK MainWndProc(  //
@@ -617,10 +441,10 @@ LRESULT CALLBACK MainWndProc(  //
 {
   switch (message) {
     case WM_CREATE: {
-      auto* state = as_ptr<CREATESTRUCT>(lParam)->lpCreateParams;
+      auto* tray = as_ptr<CREATESTRUCT>(lParam)->lpCreateParams;
       SetLastError(0);
       if (SetWindowLongPtrW(
-              hwnd, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(state))
+              hwnd, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(tray))
           != 0)
       {
         break;
@@ -630,43 +454,37 @@ LRESULT CALLBACK MainWndProc(  //
     }
     case UserMessage::TrayIcon:
       switch (LOWORD(lParam)) {
-        case WM_RBUTTONDOWN:
+        case WM_RBUTTONDOWN: {
+          auto userData = GetWindowLongPtrW(hwnd, GWLP_USERDATA);
+          throwIf(userData == 0);
+
+          as_ptr<Tray>(userData)->audio->commands.push(RemoteCommand::Query);
           ShowContextMenu(hwnd);
           break;
+        }
+        case WM_MOUSEMOVE: {
+          auto userData = GetWindowLongPtrW(hwnd, GWLP_USERDATA);
+          throwIf(userData == 0);
+
+          UpdateTooltip(*as_ptr<Tray>(userData));
+          break;
+        }
       }
       break;
-    case UserMessage::GetDefaultEndpoint: {
+    case UserMessage::AddTrayIcon: {
       auto userData = GetWindowLongPtrW(hwnd, GWLP_USERDATA);
       throwIf(userData == 0);
 
-      auto& state = *as_ptr<State>(userData);
-      state.endpointVolume.reset();
-      state.audioDevice.reset();
-
-      if (auto result = state.deviceEnumerator->GetDefaultAudioEndpoint(
-              eRender, eConsole, std::out_ptr(state.audioDevice));
-          result == E_NOTFOUND)
-      {
-        break;
-      } else {
-        throwIfCOM(result);
-      }
-
-      throwIfCOM(state.audioDevice->Activate(  //
-          __uuidof(IAudioEndpointVolume),
-          CLSCTX_INPROC_SERVER,
-          nullptr,
-          std::out_ptr(state.endpointVolume)));
-      throwIfCOM(state.endpointVolume->RegisterControlChangeNotify(
-          ComCallback<EndpointHandler>(*state.guid, hwnd)));
-      ChangeAudio(state);
+      AddTrayIcon(*as_ptr<Tray>(userData), hwnd);
       break;
     }
-    case UserMessage::ChangeAudio: {
+    case WM_TIMER: {
       auto userData = GetWindowLongPtrW(hwnd, GWLP_USERDATA);
       throwIf(userData == 0);
 
-      ChangeAudio(*as_ptr<State>(userData));
+      if (wParam == UserMessage::TrayRetryTimer) {
+        AddTrayIcon(*as_ptr<Tray>(userData), hwnd);
+      }
       break;
     }
     case WM_COMMAND:
@@ -675,18 +493,36 @@ LRESULT CALLBACK MainWndProc(  //
           auto userData = GetWindowLongPtrW(hwnd, GWLP_USERDATA);
           throwIf(userData == 0);
 
-          auto& state = *as_ptr<State>(userData);
-          if (state.dialog != nullptr) {
+          auto& tray = *as_ptr<Tray>(userData);
+          if (tray.dialog != nullptr) {
             break;
           }
 
-          state.dialog = CreateDialogIndirectParamW(  //
-              state.hInstance,
+          if (!tray.richEdit) {
+            tray.richEdit.emplace(L"Riched20.dll");
+          }
+
+          tray.dialog = CreateDialogIndirectParamW(  //
+              tray.hInstance,
               LicenseDialogData::get(),
               nullptr,
               DialogProc,
-              reinterpret_cast<LPARAM>(&state.dialog));
-          throwIf(state.dialog == nullptr);
+              reinterpret_cast<LPARAM>(&tray.dialog));
+          throwIf(tray.dialog == nullptr);
+          break;
+        }
+        case UserMessage::TrayResync: {
+          auto userData = GetWindowLongPtrW(hwnd, GWLP_USERDATA);
+          throwIf(userData == 0);
+
+          as_ptr<Tray>(userData)->audio->commands.push(RemoteCommand::Resync);
+          break;
+        }
+        case UserMessage::TrayRaises: {
+          auto userData = GetWindowLongPtrW(hwnd, GWLP_USERDATA);
+          throwIf(userData == 0);
+
+          ShowRaises(*as_ptr<Tray>(userData), hwnd);
           break;
         }
         case UserMessage::TrayExit:
@@ -701,14 +537,24 @@ LRESULT CALLBACK MainWndProc(  //
       auto userData = GetWindowLongPtrW(hwnd, GWLP_USERDATA);
       throwIf(userData == 0);
 
-      auto& state = *as_ptr<State>(userData);
-      if (state.dialog != nullptr) {
-        throwIf(DestroyWindow(state.dialog) == 0);
+      auto& tray = *as_ptr<Tray>(userData);
+      if (tray.dialog != nullptr) {
+        throwIf(DestroyWindow(tray.dialog) == 0);
       }
 
       PostQuitMessage(0);
       break;
     }
+    default:
+      if (auto taskbarCreated = TaskbarCreatedMessage();
+          taskbarCreated != 0 && message == taskbarCreated)
+      {
+        auto userData = GetWindowLongPtrW(hwnd, GWLP_USERDATA);
+        throwIf(userData == 0);
+
+        AddTrayIcon(*as_ptr<Tray>(userData), hwnd);
+      }
+      break;
   }
 
   return DefWindowProcW(hwnd, message, wParam, lParam);
@@ -716,7 +562,15 @@ LRESULT CALLBACK MainWndProc(  //
 
 int TryMain(HINSTANCE hInstance)
 {
-  auto mutex = Handle(CreateMutexW(nullptr, FALSE, L"Local\\AlwaysMute"));
+  auto options = ParseOptions();
+  if (options.command != RemoteCommand::None) {
+    return SendRemoteCommand(options.command);
+  }
+
+  auto traceRegistration = TraceRegistration();
+
+  auto mutex =
+      Handle(CreateMutexW(nullptr, FALSE, InstanceMutexName(options)));
   if (GetLastError() == ERROR_ALREADY_EXISTS) {
     return 0;
   }
@@ -726,18 +580,6 @@ int TryMain(HINSTANCE hInstance)
 
   throwIfCOM(CoInitialize(nullptr));
 
-  auto guid = GUID {};
-  throwIfCOM(CoCreateGuid(&guid));
-
-  auto deviceEnumerator = ComPtr<IMMDeviceEnumerator>();
-  throwIfCOM(CoCreateInstance(  //
-      __uuidof(MMDeviceEnumerator),
-      nullptr,
-      CLSCTX_INPROC_SERVER,
-      __uuidof(IMMDeviceEnumerator),
-      std::out_ptr(deviceEnumerator)));
-
-  auto richEdit = Library(L"Riched20.dll");
   auto cursor = LoadCursorW(nullptr, IDC_ARROW);
   throwIf(cursor == nullptr);
 
@@ -749,32 +591,27 @@ int TryMain(HINSTANCE hInstance)
   auto mainAtom = RegisterClassW(&mainWindowClass);
   throwIf(mainAtom == 0);
 
-  auto state = State  //
-      {.hInstance = hInstance,
-       .guid = &guid,
-       .deviceEnumerator = deviceEnumerator.get()};
+  auto audio = AudioThread {.hInstance = hInstance, .options = &options};
+  throwIf(audio.started.handle == nullptr);
+  auto tray = Tray {.hInstance = hInstance, .audio = &audio};
   auto window = CreateWindowW(  //
       MAKEINTATOM(mainAtom),
-      L"Message only",
+      L"AlwaysMute",
       0,
       0,
       0,
       0,
       0,
-      HWND_MESSAGE,
+      nullptr,
       nullptr,
       hInstance,
-      &state);
+      &tray);
   throwIf(window == nullptr);
 
-  throwIfCOM(deviceEnumerator->RegisterEndpointNotificationCallback(
-      ComCallback<NotificationClient>(window)));
-
-  auto sndVol = Library(L"SndVolSSO.dll");
-  auto icon = LoadIconW(sndVol.library, MAKEINTRESOURCEW(120));
+  auto icon = LoadIconW(hInstance, MAKEINTRESOURCEW(IDI_TRAY));
   throwIf(icon == nullptr);
 
-  auto trayIconData = NOTIFYICONDATAW {
+  auto trayIcon = TrayIcon(NOTIFYICONDATAW {
       .cbSize = sizeof(NOTIFYICONDATAW),
       .hWnd = window,
       .uID = 0,
@@ -782,13 +619,25 @@ int TryMain(HINSTANCE hInstance)
       .uCallbackMessage = UserMessage::TrayIcon,
       .hIcon = icon,
       .szTip = L"AlwaysMute",
-  };
-  auto trayIcon = TrayIcon(trayIconData);
+  });
+  tray.icon = &trayIcon;
 
-  auto msg = MSG {};
-  (void)PeekMessageW(&msg, window, 0, 0, PM_NOREMOVE);
-  throwIf(PostMessageW(window, UserMessage::GetDefaultEndpoint, 0, 0) == 0);
+  if (auto taskbarCreated = TaskbarCreatedMessage(); taskbarCreated != 0) {
+    (void)ChangeWindowMessageFilterEx(
+        window, taskbarCreated, MSGFLT_ALLOW, nullptr);
+  }
 
+  audio.tray = window;
+  auto worker = std::jthread(RunAudioThread, std::ref(audio));
+  throwIf(WaitForSingleObject(audio.started.handle, INFINITE) != WAIT_OBJECT_0);
+  if (!audio.running) {
+    worker.join();
+    return audio.exitCode;
+  }
+
+  throwIf(PostMessageW(window, UserMessage::AddTrayIcon, 0, 0) == 0);
+
+  auto msg = MSG {};
   while (true) {
     if (auto result = GetMessageW(&msg, nullptr, 0, 0); result == 0) {
       break;
@@ -796,14 +645,16 @@ int TryMain(HINSTANCE hInstance)
       throwIf(result == -1);
     }
 
-    if (state.dialog != nullptr && IsDialogMessageW(state.dialog, &msg) != 0) {
+    if (tray.dialog != nullptr && IsDialogMessageW(tray.dialog, &msg) != 0) {
       continue;
     }
 
     (void)DispatchMessageW(&msg);
   }
 
-  return static_cast<int>(msg.wParam);
+  worker.request_stop();
+  worker.join();
+  return audio.exitCode;
 }
 
 }  // namespace
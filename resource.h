@@ -0,0 +1,5 @@
+// SPDX-License-Identifier: GPL-3.0
+
+#pragma once
+
+#define IDI_TRAY 1